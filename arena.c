@@ -0,0 +1,181 @@
+/*
+ * Copyright (c) 2021 Jiajia Liu <liujia6264@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+
+#define ARENA_ALIGN	16
+#define ALIGN(n, a)	(((n) + ((a) - 1)) & ~((a) - 1))
+
+/* largest chunk kept across resets, a bigger round goes back to the start */
+#define ARENA_KEEP_MAX	(64 * 1024)
+
+struct chunk {
+	struct chunk *next;
+	size_t size;
+	size_t used;
+	unsigned char data[] __attribute__((aligned(ARENA_ALIGN)));
+};
+
+struct arena {
+	struct chunk *first;
+	size_t init;
+	size_t size;
+	size_t total;
+};
+
+static struct chunk *chunk_new(size_t size)
+{
+	struct chunk *c;
+
+	c = malloc(sizeof(*c) + size);
+	if (c == NULL)
+		return NULL;
+
+	c->next = NULL;
+	c->size = size;
+	c->used = 0;
+
+	return c;
+}
+
+struct arena *arena_create(size_t size)
+{
+	struct arena *a;
+
+	a = malloc(sizeof(*a));
+	if (a == NULL)
+		return NULL;
+
+	a->init = a->size = ALIGN(size, ARENA_ALIGN);
+	a->total = 0;
+	a->first = chunk_new(a->size);
+	if (a->first == NULL) {
+		free(a);
+		return NULL;
+	}
+
+	return a;
+}
+
+void arena_destroy(struct arena *a)
+{
+	struct chunk *c, *next;
+
+	if (a == NULL)
+		return;
+
+	for (c = a->first; c; c = next) {
+		next = c->next;
+		free(c);
+	}
+	free(a);
+}
+
+void *arena_alloc(struct arena *a, size_t size)
+{
+	struct chunk *c = a->first;
+	void *ptr;
+
+	size = ALIGN(size, ARENA_ALIGN);
+
+	if (c == NULL || c->size - c->used < size) {
+		size_t csize = a->size;
+
+		if (csize < size)
+			csize = size;
+
+		c = chunk_new(csize);
+		if (c == NULL)
+			return NULL;
+
+		c->next = a->first;
+		a->first = c;
+	}
+
+	ptr = c->data + c->used;
+	c->used += size;
+	a->total += size;
+
+	return ptr;
+}
+
+void *arena_calloc(struct arena *a, size_t n, size_t size)
+{
+	void *ptr;
+
+	if (size && n > SIZE_MAX / size)
+		return NULL;
+
+	ptr = arena_alloc(a, n * size);
+	if (ptr)
+		memset(ptr, 0, n * size);
+
+	return ptr;
+}
+
+char *arena_strndup(struct arena *a, const char *str, size_t n)
+{
+	char *ptr;
+
+	ptr = arena_alloc(a, n + 1);
+	if (ptr) {
+		memcpy(ptr, str, n);
+		ptr[n] = '\0';
+	}
+
+	return ptr;
+}
+
+/*
+ * Keep a single chunk. If the last round needed more than one, the kept
+ * chunk is resized to the high-water mark so that the next round fits
+ * without going back to malloc. A round larger than ARENA_KEEP_MAX is
+ * taken as a one-off and the chunk shrinks back to its initial size.
+ */
+void arena_reset(struct arena *a)
+{
+	struct chunk *c, *next;
+
+	if (a->first && a->first->next == NULL) {
+		a->first->used = 0;
+		a->total = 0;
+		return;
+	}
+
+	for (c = a->first; c; c = next) {
+		next = c->next;
+		free(c);
+	}
+
+	if (a->total > ARENA_KEEP_MAX && a->total > a->init)
+		a->size = a->init;
+	else if (a->size < a->total)
+		a->size = a->total;
+	a->total = 0;
+
+	a->first = chunk_new(a->size);
+}
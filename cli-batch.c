@@ -0,0 +1,171 @@
+/*
+ * Batch Script Execution
+ *
+ * Copyright (c) 2021 Jiajia Liu <liujia6264@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "cli-term.h"
+#include "stream.h"
+
+#define BATCH_FLUSH		(64 * 1024)
+#define BATCH_MAXDEPTH		8
+
+static int batch_depth;
+
+static double batch_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void batch_flush(struct stream *out, int fd)
+{
+	while (stream_ndata(out)) {
+		if (stream_flush(out, fd) < 0 && errno != EINTR)
+			break;
+	}
+}
+
+/*
+ * Run every line of the script at path with cmd_exec_buf(). Blank lines
+ * and lines starting with '!' or '#' are skipped. The script is mapped
+ * privately and its lines are terminated in place. Output goes to out and,
+ * when fd is not negative, is written to fd every BATCH_FLUSH bytes and
+ * at the end. A failing line is reported with its number and stops the
+ * script unless CMD_SOURCE_CONTINUE is set.
+ *
+ * Returns 0 if all lines succeeded, the status of the first failure, or a
+ * negative errno if the script cannot be read.
+ */
+int cmd_source(struct cmd_tree *tree, const char *path, int flags,
+	       struct stream *out, int fd, struct cmd_source_stats *st)
+{
+	struct cmdopt *opt;
+	struct stat sb;
+	char *map = NULL, *p, *end, *nl, last[CMD_LINE_MAX];
+	double start = batch_now();
+	int sfd, ret = 0, status;
+
+	memset(st, 0, sizeof(*st));
+
+	if (batch_depth >= BATCH_MAXDEPTH)
+		return -ELOOP;
+
+	sfd = open(path, O_RDONLY);
+	if (sfd < 0)
+		return -errno;
+
+	if (fstat(sfd, &sb) < 0) {
+		ret = -errno;
+		close(sfd);
+		return ret;
+	}
+
+	if (sb.st_size) {
+		map = mmap(NULL, sb.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+			   sfd, 0);
+		if (map == MAP_FAILED) {
+			ret = -errno;
+			close(sfd);
+			return ret;
+		}
+	}
+	close(sfd);
+
+	opt = cmdopt_create();
+	if (opt == NULL) {
+		if (map)
+			munmap(map, sb.st_size);
+		return -ENOMEM;
+	}
+
+	batch_depth++;
+	for (p = map, end = map + sb.st_size; p < end; p = nl + 1) {
+		nl = memchr(p, '\n', end - p);
+		if (nl) {
+			*nl = '\0';
+		} else if (end - p < sizeof(last)) {
+			/* no room to terminate the last line in the mapping */
+			memcpy(last, p, end - p);
+			last[end - p] = '\0';
+			p = last;
+			nl = end - 1;
+		} else {
+			/* too long for any command, as cmd_exec_buf() finds too */
+			nl = end - 1;
+			p = NULL;
+		}
+
+		st->lines++;
+		if (p) {
+			p += strspn(p, " \t\r");
+			if (*p == '\0' || *p == '!' || *p == '#')
+				continue;
+		}
+
+		st->commands++;
+		if (p) {
+			status = cmd_exec_buf(tree, p, out, opt);
+		} else {
+			stream_puts(out, "%% Command too long.\r\n");
+			status = CMD_ERR_EXEED_ARGC_MAX;
+		}
+
+		/* a command left running in the background did start fine */
+		if (status != CMD_SUCCESS && status != CMD_SUCCESS_DAEMON) {
+			st->failed++;
+			stream_puts(out, "%% %s:%lu: failed with status %d\r\n",
+				    path, st->lines, status);
+			if (ret == 0)
+				ret = status;
+			if (!(flags & CMD_SOURCE_CONTINUE))
+				break;
+		}
+
+		if (fd >= 0 && stream_ndata(out) >= BATCH_FLUSH)
+			batch_flush(out, fd);
+	}
+	batch_depth--;
+
+	if (fd >= 0)
+		batch_flush(out, fd);
+
+	cmdopt_destroy(opt);
+	if (map)
+		munmap(map, sb.st_size);
+
+	st->seconds = batch_now() - start;
+
+	return ret;
+}
@@ -4,19 +4,13 @@
 #include <errno.h>
 #include <string.h>
 #include "cli-term.h"
-#include "hashtable.h"
-
-static void kpair_dump(const void *key, const void *value, void *data)
-{
-	struct term *term = data;
-
-	term_print(term, "  %s: %s.\r\n", (const char *)key, (const char *)value);
-}
+#include "regexp-cache.h"
+#include "output-cache.h"
 
 void print_args(struct term *term, struct cmdopt *opt)
 {
 	int i;
-	size_t count = hashtable_count(opt->kpairs);
+	int count = __builtin_popcount(opt->slotmask);
 
 	if (opt->argc) {
 		term_print(term, "argc %d\r\n", opt->argc);
@@ -25,8 +19,11 @@ void print_args(struct term *term, struct cmdopt *opt)
 	}
 
 	if (count) {
-		term_print(term, "keywords %zu\r\n", count);
-		hashtable_travel(opt->kpairs, kpair_dump, term);
+		term_print(term, "keywords %d\r\n", count);
+		for (i = 0; i < CMD_MAXSLOTS; i++) {
+			if (opt->slotmask & (1U << i))
+				term_print(term, "  %s: %s.\r\n", opt->keys[i], opt->values[i]);
+		}
 	}
 }
 
@@ -51,6 +48,262 @@ COMMAND(show_cmdtree, NULL,
 	return 0;
 }
 
+COMMAND(show_regexp_cache, NULL,
+	"show regexp-cache",
+	SHOW_STR
+	"Compiled regular expressions of pipe filters\n")
+{
+	struct regexp_cache_stats st;
+
+	regexp_cache_stats(&st);
+	term_print(term, "entries %u/%u\r\n", st.count, st.capacity);
+	term_print(term, "hits %lu, misses %lu, evictions %lu\r\n",
+		   st.hits, st.misses, st.evictions);
+	return 0;
+}
+
+COMMAND(show_output_cache, NULL,
+	"show output-cache",
+	SHOW_STR
+	"Outputs of cacheable commands\n")
+{
+	struct output_cache_stats st;
+
+	output_cache_stats(&st);
+	term_print(term, "entries %u/%u\r\n", st.count, st.capacity);
+	term_print(term, "hits %lu, misses %lu, expired %lu, evictions %lu\r\n",
+		   st.hits, st.misses, st.expired, st.evictions);
+	return 0;
+}
+
+COMMAND(clear_output_cache, NULL,
+	"clear output-cache",
+	"Reset functions\n"
+	"Drop the cached command outputs\n")
+{
+	output_cache_clear();
+	return 0;
+}
+
+struct statsopt {
+	bool reset;
+};
+
+static struct statsopt statsopt;
+
+static struct optattr stats_attrs[] = {
+	{
+		.index = -1,
+		.key = "reset",
+		.offset = offsetof(struct statsopt, reset),
+	},
+};
+
+static struct cmdoptattr stats_optattr = {
+	.attrs = stats_attrs,
+	.size = sizeof(stats_attrs)/sizeof(stats_attrs[0]),
+	.buf = &statsopt,
+	.bufsize = sizeof(struct statsopt),
+};
+
+COMMAND(show_command_stats, &stats_optattr,
+	"show command-stats {reset}",
+	SHOW_STR
+	"Calls, errors, output and latency of each command\n"
+	"Clear the statistics once shown\n")
+{
+	cmd_stats_show(term_cmd_tree(term), term_ostream(term));
+	if (statsopt.reset)
+		cmd_stats_reset(term_cmd_tree(term));
+	return 0;
+}
+
+COMMAND(show_plugins, NULL,
+	"show plugins",
+	SHOW_STR
+	"Commands added at runtime\n")
+{
+	cmd_modules_show(term_ostream(term));
+	return 0;
+}
+
+COMMAND(plugin_load, NULL,
+	"plugin load FILE",
+	"Commands of shared objects\n"
+	"Add the commands of a shared object\n"
+	"Path to the shared object\n")
+{
+	char err[256];
+	int ret;
+
+	ret = cmd_plugin_load(opt->argv[0], err, sizeof(err));
+	if (ret < 0) {
+		term_print(term, "%% Cannot load - %s.\r\n", err);
+		return CMD_WARNING;
+	}
+
+	return 0;
+}
+
+COMMAND(plugin_unload, NULL,
+	"plugin unload FILE",
+	"Commands of shared objects\n"
+	"Remove the commands of a shared object\n"
+	"Path the shared object was loaded from\n")
+{
+	int ret;
+
+	ret = cmd_plugin_unload(opt->argv[0]);
+	if (ret < 0) {
+		term_print(term, "%% Cannot unload - %s.\r\n", strerror(-ret));
+		return CMD_WARNING;
+	}
+
+	return 0;
+}
+
+struct lengthopt {
+	int lines;
+};
+
+static struct lengthopt lengthopt;
+
+static struct optattr length_attrs[] = {
+	{
+		.index = 0,
+		.offset = offsetof(struct lengthopt, lines),
+	},
+};
+
+static struct cmdoptattr length_optattr = {
+	.attrs = length_attrs,
+	.size = sizeof(length_attrs)/sizeof(length_attrs[0]),
+	.buf = &lengthopt,
+	.bufsize = sizeof(struct lengthopt),
+};
+
+COMMAND(terminal_length, &length_optattr,
+	"terminal length INT<0-512>",
+	"Set terminal line parameters\n"
+	"Lines per page of output, 0 for no paging\n"
+	"Number of lines\n")
+{
+	term_set_length(term, lengthopt.lines);
+	return 0;
+}
+
+struct sourceopt {
+	const char *path;
+	bool cont;
+};
+
+static struct sourceopt sourceopt;
+
+static struct optattr source_attrs[] = {
+	{
+		.index = 0,
+		.offset = offsetof(struct sourceopt, path),
+	},
+	{
+		.index = -1,
+		.key = "continue",
+		.offset = offsetof(struct sourceopt, cont),
+	},
+};
+
+static struct cmdoptattr source_optattr = {
+	.attrs = source_attrs,
+	.size = sizeof(source_attrs)/sizeof(source_attrs[0]),
+	.buf = &sourceopt,
+	.bufsize = sizeof(struct sourceopt),
+};
+
+COMMAND(source_file, &source_optattr,
+	"source FILE {continue}",
+	"Run the commands of a script\n"
+	"Script file, one command per line\n"
+	"Go on after a failing command\n")
+{
+	struct cmd_source_stats st;
+	const char *path = sourceopt.path;
+	int ret;
+
+	/*
+	 * A script sourcing another one reuses sourceopt. Unless piped, the
+	 * output goes to the terminal as it comes rather than all at the end.
+	 */
+	ret = cmd_source(term_cmd_tree(term), path,
+			 sourceopt.cont ? CMD_SOURCE_CONTINUE : 0,
+			 term_ostream(term), opt->pipe ? -1 : term_ofd(term), &st);
+	if (ret < 0) {
+		term_print(term, "%% Cannot source - %s.\r\n", strerror(-ret));
+		return CMD_WARNING;
+	}
+
+	term_print(term, "%% %lu commands, %lu failed in %.3f s\r\n",
+		   st.commands, st.failed, st.seconds);
+
+	return ret == 0 ? CMD_SUCCESS : CMD_WARNING;
+}
+
+struct watchopt {
+	int seconds;
+};
+
+static struct watchopt watchopt;
+
+static void watchopt_init(void *buf, size_t size)
+{
+	struct watchopt *w = buf;
+
+	w->seconds = 2;
+}
+
+static struct optattr watch_attrs[] = {
+	{
+		.index = -1,
+		.key = "-n",
+		.offset = offsetof(struct watchopt, seconds),
+	},
+};
+
+static struct cmdoptattr watch_optattr = {
+	.attrs = watch_attrs,
+	.size = sizeof(watch_attrs)/sizeof(watch_attrs[0]),
+	.buf = &watchopt,
+	.bufsize = sizeof(struct watchopt),
+	.init = watchopt_init,
+};
+
+COMMAND(watch_command, &watch_optattr,
+	"watch {-n INT<1-86400>} .COMMAND",
+	"Run a command periodically until a key is pressed\n"
+	"Interval\n"
+	"Seconds between runs, 2 by default\n"
+	"Command to run, without pipe\n")
+{
+	char line[CMD_LINE_MAX];
+	int i, l = 0, ret;
+
+	/* the pipe would only see what watch prints, not the command */
+	if (opt->pipe) {
+		term_print(term, "%% Cannot watch - pipe not supported.\r\n");
+		return CMD_WARNING;
+	}
+
+	for (i = 0; i < opt->argc && l < sizeof(line); i++)
+		l += snprintf(line + l, sizeof(line) - l, "%s%s", i ? " " : "",
+			      opt->argv[i]);
+
+	ret = term_watch(term, line, watchopt.seconds * 1000);
+	if (ret < 0) {
+		term_print(term, "%% Cannot watch - %s.\r\n", strerror(-ret));
+		return CMD_WARNING;
+	}
+
+	return CMD_SUCCESS_DAEMON;
+}
+
 COMMAND(cmd_system, NULL,
 	"system .ARGS",
 	"system shell\n"
@@ -131,7 +384,7 @@ static struct optattr keyword_attrs[] = {
 		.index = -1,
 		.key = "third",
 		.offset = offsetof(struct keywordopt, number),
-		.set = set_i32,
+		.set = NULL,
 	},
 	{
 		.index = -1,
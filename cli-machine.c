@@ -0,0 +1,210 @@
+/*
+ * Machine Mode Sessions
+ *
+ * Copyright (c) 2021 Jiajia Liu <liujia6264@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+
+#include "cli-term.h"
+#include "event-loop.h"
+#include "stream.h"
+
+#define MACHINE_BUFSIZE		(64 * 1024)
+#define MACHINE_HIGHWAT		(256 * 1024)
+
+/*
+ * A machine session takes one command per line, without echo, prompt or
+ * line editing, and runs every complete line of a read at once. Each
+ * command is answered by a "<status> <length>\n" header, status being the
+ * CMD_* code, followed by length bytes of output. Responses are written
+ * in order, so a client may send any number of commands before reading.
+ */
+struct machine {
+	int fd;
+	int stop;
+	int eof;
+	int skip;		/* discarding an overlong line */
+
+	struct event_source *source;
+
+	struct cmd_tree *cmd_tree;
+	struct cmdopt *cmdopt;
+
+	struct stream *out;	/* framed responses */
+	struct stream *res;	/* output of the running command */
+
+	size_t len;
+	char buf[MACHINE_BUFSIZE];
+};
+
+static void machine_respond(struct machine *m, int status)
+{
+	stream_puts(m->out, "%d %zu\n", status, stream_ndata(m->res));
+	stream_append(m->out, m->res);
+}
+
+static void machine_parse(struct machine *m)
+{
+	char *p = m->buf, *end = m->buf + m->len, *nl;
+
+	while ((nl = memchr(p, '\n', end - p)) != NULL) {
+		*nl = '\0';
+		if (nl > p && nl[-1] == '\r')
+			nl[-1] = '\0';
+
+		if (m->skip)
+			m->skip = 0;
+		else
+			machine_respond(m, cmd_exec_buf(cmd_tree_update(&m->cmd_tree),
+							p, m->res, m->cmdopt));
+		p = nl + 1;
+	}
+
+	m->len = end - p;
+	memmove(m->buf, p, m->len);
+
+	/* no room left for the end of the line */
+	if (m->len >= CMD_LINE_MAX) {
+		if (!m->skip) {
+			stream_puts(m->res, "%% Command too long.\r\n");
+			machine_respond(m, CMD_ERR_EXEED_ARGC_MAX);
+		}
+		m->skip = 1;
+		m->len = 0;
+	}
+}
+
+/*
+ * Reading stops while too many responses are pending, and after the
+ * client closed its side the session ends once they are all written.
+ */
+static void machine_update(struct machine *m)
+{
+	uint32_t mask = 0;
+
+	if (!m->eof && stream_ndata(m->out) < MACHINE_HIGHWAT)
+		mask |= EVENT_READABLE;
+	if (stream_ndata(m->out))
+		mask |= EVENT_WRITABLE;
+
+	if (mask == 0)
+		m->stop = 1;
+	else
+		event_source_fd_update(m->source, mask);
+}
+
+static int machine_handle(int fd, uint32_t mask, void *data)
+{
+	struct machine *m = data;
+	ssize_t n;
+
+	if (m->stop)
+		return 0;
+
+	if ((mask & EVENT_READABLE) && !m->eof &&
+	    stream_ndata(m->out) < MACHINE_HIGHWAT) {
+		n = read(fd, m->buf + m->len, sizeof(m->buf) - m->len);
+		if (n > 0) {
+			m->len += n;
+			machine_parse(m);
+		} else if (n == 0 || (errno != EAGAIN && errno != EINTR)) {
+			m->eof = 1;
+		}
+	}
+
+	if (stream_ndata(m->out) && stream_flush(m->out, fd) < 0 &&
+	    errno != EAGAIN && errno != EINTR) {
+		m->stop = 1;
+		return 0;
+	}
+
+	if ((mask & EVENT_HANGUP) && !(mask & EVENT_READABLE)) {
+		m->stop = 1;
+		return 0;
+	}
+
+	machine_update(m);
+
+	return 0;
+}
+
+struct machine *machine_create(struct event_loop *loop, int fd)
+{
+	struct machine *m;
+	int flags;
+
+	m = calloc(1, sizeof(*m));
+	if (m == NULL)
+		return NULL;
+
+	m->fd = fd;
+	flags = fcntl(fd, F_GETFL);
+	if (flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1)
+		goto err;
+
+	m->out = stream_new();
+	m->res = stream_new();
+	m->cmdopt = cmdopt_create();
+	m->cmd_tree = cmd_tree_get_default();
+	if (!m->out || !m->res || !m->cmdopt || !m->cmd_tree)
+		goto err;
+
+	m->source = event_loop_add_fd(loop, fd, 1, EVENT_READABLE,
+				      machine_handle, m);
+	if (m->source == NULL)
+		goto err;
+
+	return m;
+
+err:
+	machine_destroy(m);
+	return NULL;
+}
+
+void machine_destroy(struct machine *m)
+{
+	if (m->source)
+		event_source_remove(m->source);
+	cmd_tree_put(m->cmd_tree);
+	if (m->cmdopt)
+		cmdopt_destroy(m->cmdopt);
+	if (m->res)
+		stream_free(m->res);
+	if (m->out)
+		stream_free(m->out);
+	free(m);
+}
+
+int machine_fd(struct machine *m)
+{
+	return m->fd;
+}
+
+int machine_want_exit(struct machine *m)
+{
+	return m->stop;
+}
@@ -22,20 +22,26 @@
  * THE SOFTWARE.
  */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <spawn.h>
 #include <sys/uio.h>
+#include <sys/wait.h>
+#include <sys/syscall.h>
 #include <ctype.h>
 #include <arpa/telnet.h>
 
 #include "cli-term.h"
 #include "event-loop.h"
 #include "stream.h"
-#include "hashtable.h"
+#include "arena.h"
 
 #define CTRL(c)		(c - '@')
 #define CTRL_BACKSPACE	CTRL('H')
@@ -49,9 +55,15 @@
 #define TERM_MAXHIST	32
 
 #define TERM_DEFAULT_NAME	"Chaconne"
+#define TERM_ARENA_SIZE		4096
+#define TERM_JOB_HIGHWAT	(64 * 1024)
+#define TERM_DEFAULT_LENGTH	24
+#define TERM_MORE		" --More-- "
+
+extern char **environ;
 
 struct buffer {
-	char buf[8192];
+	char buf[CMD_LINE_MAX];
 	int cp, len, max;
 };
 
@@ -60,66 +72,73 @@ struct history {
 	int cp, index;
 };
 
-static size_t string_hash(const void *data)
-{
-	size_t hash = 0;
-	const char *p;
-
-	for (p = data; *p; p++) {
-		hash = hash * 31 + *p;
-	}
-
-	return hash;
-}
-
-static int string_compare(const void *a, const void *b)
-{
-	return strcmp(a, b);
-}
-
 struct cmdopt *cmdopt_create(void)
 {
 	struct cmdopt *opt;
-	struct kpattr attr = {
-		.key_is_ptr = 1,
-		.value_is_ptr = 1,
-
-		.hash = string_hash,
-		.compare = string_compare,
-		.free_key = NULL,
-		.free_value = NULL,
-	};
 
 	opt = malloc(sizeof(*opt));
 	if (!opt)
 		return NULL;
 
-	opt->argc = 0;
-	opt->kpairs = hashtable_create(32, &attr);
-	if (!opt->kpairs) {
-		free(opt);
-		return NULL;
-	}
+	cmdopt_clear(opt);
 
 	return opt;
 }
 
 void cmdopt_clear(struct cmdopt *opt)
 {
-	hashtable_clear(opt->kpairs);
 	opt->argc = 0;
+	opt->slotmask = 0;
+	opt->pipe = NULL;
 }
 
 void cmdopt_destroy(struct cmdopt *opt)
 {
-	if (opt) {
-		hashtable_destroy(opt->kpairs);
-		free(opt);
-	}
+	free(opt);
 }
 
+/* an external pipe command running on behalf of a terminal */
+struct term_job {
+	pid_t pid;
+	int exited;
+	int killed;
+
+	int in_fd;		/* command output fed to the child */
+	int out_fd;		/* output of the child */
+	int pid_fd;
+
+	struct stream *in;
+	struct event_source *in_source;
+	struct event_source *out_source;
+	struct event_source *pid_source;
+};
+
+/* the rest of a paged command output, generated a page at a time */
+struct term_pager {
+	term_more_fn fn;
+	void *data;
+	void (*release)(void *data);
+
+	struct stream *held;	/* generated but not shown yet */
+	int done;
+};
+
+/* a command rerun by a timer, see term_watch() */
+struct term_watch {
+	struct event_source *timer;
+	int interval_ms;
+	char line[CMD_LINE_MAX];
+
+	/* output of the last run and where its lines start */
+	char *buf;
+	size_t *lines;
+	size_t nr_lines;
+};
+
 struct term {
 	int fd;
+	int ofd;
+	int length;		/* lines per page, 0 for no paging */
 
 	struct buffer *in;
 	struct stream *out;
@@ -134,8 +153,16 @@ struct term {
 	struct event_source *source;
 	struct event_source *signals;
 
-	struct cmd_node *cmd_tree;
+	struct cmd_tree *cmd_tree;
 	struct cmdopt *cmdopt;
+
+	/* allocations living as long as the command being handled */
+	struct arena *arena;
+
+	/* input is not read while a pipe command runs */
+	struct term_job *job;
+	struct term_pager *pager;
+	struct term_watch *watch;
 };
 
 const char *history_previous(struct history *hist)
@@ -257,7 +284,8 @@ static void history_print(struct history *hist, struct stream *out)
 
 void term_show_history(struct term *term)
 {
-	history_print(term->hist, term->out);
+	if (term->hist)
+		history_print(term->hist, term->out);
 }
 
 void term_quit(struct term *term)
@@ -275,12 +303,18 @@ struct stream *term_ostream(struct term *term)
 	return term->out;
 }
 
+/* released when the current command completes */
+struct arena *term_arena(struct term *term)
+{
+	return term->arena;
+}
+
 struct cmdopt *term_cmdopt(struct term *term)
 {
 	return term->cmdopt;
 }
 
-struct cmd_node *term_cmd_tree(struct term *term)
+struct cmd_tree *term_cmd_tree(struct term *term)
 {
 	return term->cmd_tree;
 }
@@ -292,18 +326,56 @@ static void term_prompt(struct term *term)
 
 static void term_read(struct term *term, int c);
 
+/* wait for input, or only for the pipe command output while it runs */
+static void term_wait_input(struct term *term)
+{
+	struct term_job *job = term->job;
+
+	if (term->source)
+		event_source_fd_update(term->source, job ? 0 : EVENT_READABLE);
+	if (job && job->out_source)
+		event_source_fd_update(job->out_source, EVENT_READABLE);
+}
+
+/*
+ * Output goes out once the terminal fd is writable, or right away when
+ * it is not the input fd, as for a piped stdin which never polls
+ * writable.
+ */
+static void term_kick(struct term *term)
+{
+	if (term->ofd == term->fd && term->source) {
+		event_source_fd_update(term->source, EVENT_WRITABLE);
+		return;
+	}
+
+	term_flush(term);
+	term_wait_input(term);
+}
+
+static void term_job_hangup(struct term *term);
+
 static int term_handle_input(int fd, uint32_t mask, void *data)
 {
 	char c;
 	struct term *term = data;
 	struct event_source *source = term->source;
 
+	if (source == NULL)
+		return 0;
+
 	if (mask & EVENT_HANGUP)
 		mask |= (EVENT_WRITABLE | EVENT_READABLE);
 
 	if (mask & EVENT_WRITABLE) {
 		term_flush(term);
-		event_source_fd_update(source, EVENT_READABLE);
+		term_wait_input(term);
+	}
+
+	if (term->job) {
+		if (mask & EVENT_HANGUP)
+			term_job_hangup(term);
+		return 0;
 	}
 
 	if (mask & EVENT_READABLE) {
@@ -311,7 +383,7 @@ static int term_handle_input(int fd, uint32_t mask, void *data)
 			exit(1);
 
 		term_read(term, c);
-		event_source_fd_update(source, EVENT_WRITABLE);
+		term_kick(term);
 	}
 
 	return 0;
@@ -365,6 +437,12 @@ int term_fd(struct term *term)
 	return term->fd;
 }
 
+/* -1 for a command run by cmd_exec_buf() */
+int term_ofd(struct term *term)
+{
+	return term->ofd;
+}
+
 struct term *term_create(struct event_loop *loop, int fd, const char *name)
 {
 	struct term *term;
@@ -378,6 +456,10 @@ struct term *term_create(struct event_loop *loop, int fd, const char *name)
 		term->name = TERM_DEFAULT_NAME;
 
 	term->fd = fd;
+	term->ofd = fd == STDIN_FILENO ? STDOUT_FILENO : fd;
+	term->length = TERM_DEFAULT_LENGTH;
+	if (fd == STDIN_FILENO && !isatty(fd))
+		term->length = 0;
 	term->in = calloc(1, sizeof(struct buffer));
 	if (term->in == NULL)
 		goto err_in_buf;
@@ -392,16 +474,24 @@ struct term *term_create(struct event_loop *loop, int fd, const char *name)
 		goto err_history;
 
 	term->loop = loop;
-	term->source = event_loop_add_fd(term->loop, fd, 1, EVENT_WRITABLE,
+	term->source = event_loop_add_fd(term->loop, fd, 1,
+					 term->ofd == fd ? EVENT_WRITABLE : EVENT_READABLE,
 					 term_handle_input, term);
 	if (term->source == NULL)
 		goto err_event_source;
 
+	term->arena = arena_create(TERM_ARENA_SIZE);
+	if (!term->arena)
+		goto err_arena;
+	stream_set_arena(term->out, term->arena);
+
 	term->cmdopt = cmdopt_create();
 	if (!term->cmdopt)
 		goto err_cmdopt;
 
-	term->cmd_tree = cmd_tree_build_default();
+	term->cmd_tree = cmd_tree_get_default();
+	if (!term->cmd_tree)
+		goto err_cmd_tree;
 
 	if (fd != STDIN_FILENO) {
 		//term_will_echo(term);
@@ -411,10 +501,16 @@ struct term *term_create(struct event_loop *loop, int fd, const char *name)
 
 	term_help_prompt(term);
 	term_prompt(term);
+	if (term->ofd != fd)
+		term_flush(term);
 
 	return term;
 
+err_cmd_tree:
+	cmdopt_destroy(term->cmdopt);
 err_cmdopt:
+	arena_destroy(term->arena);
+err_arena:
 	event_source_remove(term->source);
 err_event_source:
 	history_destroy(term->hist);
@@ -436,13 +532,30 @@ void term_run(struct term *term)
 	}
 }
 
+static void term_job_free(struct term_job *job);
+static void term_pager_end(struct term *term);
+static void term_watch_end(struct term *term);
+
 void term_destroy(struct term *term)
 {
-	cmd_tree_delete(term->cmd_tree);
+	if (term->pager)
+		term_pager_end(term);
+	if (term->watch)
+		term_watch_end(term);
+	if (term->job) {
+		kill(term->job->pid, SIGKILL);
+		if (!term->job->exited)
+			waitpid(term->job->pid, NULL, 0);
+		term_job_free(term->job);
+	}
+
+	cmd_tree_put(term->cmd_tree);
 	cmdopt_destroy(term->cmdopt);
-	event_source_remove(term->source);
+	if (term->source)
+		event_source_remove(term->source);
 	history_destroy(term->hist);
 	stream_free(term->out);
+	arena_destroy(term->arena);
 	free(term->in);
 	free(term);
 }
@@ -538,18 +651,601 @@ static void term_self_insert(struct term *term, int c)
 	}
 }
 
+static void term_pager_show(struct term *term, size_t lines);
+
 static void term_execute(struct term *term)
 {
+	int ret;
+
 	stream_puts(term->out, "\r\n");
 	term_flush(term);
-	cmd_execute(term, term->cmd_tree, term->in->buf);
+	ret = cmd_execute(term, cmd_tree_update(&term->cmd_tree), term->in->buf);
 	history_add(term->hist, term->in->buf);
 
 	term->in->cp = 0;
 	term->in->len = 0;
 	term->in->buf[0] = '\0';
 
+	/* the prompt comes back when the pipe command or the pager is done */
+	if (term->pager)
+		term_pager_show(term, term->length - 1);
+	else if (ret != CMD_SUCCESS_DAEMON && !term->stop)
+		term_prompt(term);
+	arena_reset(term->arena);
+}
+
+void term_set_length(struct term *term, int lines)
+{
+	term->length = lines;
+}
+
+static void term_pager_end(struct term *term)
+{
+	struct term_pager *pg = term->pager;
+
+	term->pager = NULL;
+	if (pg->release)
+		pg->release(pg->data);
+	stream_free(pg->held);
+	free(pg);
+}
+
+/* the generator writes into the held stream rather than the terminal */
+static void term_pager_generate(struct term *term)
+{
+	struct term_pager *pg = term->pager;
+	struct stream *out = term->out;
+
+	term->out = pg->held;
+	if (pg->fn(term, pg->data) <= 0)
+		pg->done = 1;
+	term->out = out;
+}
+
+/*
+ * Show up to lines more lines, generating no more output than that
+ * takes, then wait at --More-- or finish.
+ */
+static void term_pager_show(struct term *term, size_t lines)
+{
+	struct term_pager *pg = term->pager;
+	size_t n, len, shown = 0;
+
+	for (;;) {
+		n = lines - shown;
+		len = stream_lines_len(pg->held, &n);
+		stream_move(term->out, pg->held, len);
+		shown += n;
+
+		if (shown >= lines || pg->done)
+			break;
+		term_pager_generate(term);
+	}
+
+	if (pg->done && (shown < lines || !stream_ndata(pg->held))) {
+		stream_append(term->out, pg->held);
+		term_pager_end(term);
+		if (!term->stop)
+			term_prompt(term);
+	} else {
+		stream_puts(term->out, TERM_MORE);
+	}
+}
+
+static void term_pager_key(struct term *term, int c)
+{
+	stream_puts(term->out, "\r%*s\r", (int)strlen(TERM_MORE), "");
+
+	if (c == 'q' || c == 'Q' || c == CTRL('C')) {
+		term_pager_end(term);
+		term_prompt(term);
+	} else if (c == '\r' || c == '\n') {
+		term_pager_show(term, 1);
+	} else {
+		term_pager_show(term, term->length - 1);
+	}
+
+	arena_reset(term->arena);
+}
+
+/*
+ * Page the output of fn. Without paging, or for a pipe, all of it is
+ * generated by term_more_drain() right away.
+ */
+int term_more(struct term *term, term_more_fn fn, void *data,
+	      void (*release)(void *data))
+{
+	struct term_pager *pg;
+
+	pg = calloc(1, sizeof(*pg));
+	if (pg == NULL)
+		goto err;
+
+	pg->held = stream_new();
+	if (pg->held == NULL) {
+		free(pg);
+		goto err;
+	}
+	stream_set_arena(pg->held, term->arena);
+
+	pg->fn = fn;
+	pg->data = data;
+	pg->release = release;
+	term->pager = pg;
+
+	if (term->length <= 1)
+		term_more_drain(term);
+
+	return 0;
+
+err:
+	if (release)
+		release(data);
+	return -ENOMEM;
+}
+
+void term_more_drain(struct term *term)
+{
+	if (!term->pager)
+		return;
+
+	while (!term->pager->done)
+		term_pager_generate(term);
+
+	stream_append(term->out, term->pager->held);
+	term_pager_end(term);
+}
+
+#define WATCH_TOP	3	/* screen row of the first output line */
+
+/* split the output into lines, dropping the CR of CR LF */
+static size_t term_watch_split(char *buf, size_t len, size_t *lines)
+{
+	size_t n = 0, i, start = 0;
+
+	for (i = 0; i < len; i++) {
+		if (buf[i] != '\n')
+			continue;
+		buf[i] = '\0';
+		if (i > start && buf[i - 1] == '\r')
+			buf[i - 1] = '\0';
+		lines[n++] = start;
+		start = i + 1;
+	}
+	if (start < len) {
+		buf[len] = '\0';
+		lines[n++] = start;
+	}
+
+	return n;
+}
+
+/*
+ * Run the command again and move only the lines which differ from the
+ * last run to the screen, addressing their rows with the cursor.
+ */
+static int term_watch_run(void *data)
+{
+	struct term *term = data;
+	struct term_watch *w = term->watch;
+	struct stream *s = stream_new();
+	size_t len, n, i, *lines;
+	char *buf;
+
+	if (s == NULL)
+		goto rearm;
+
+	cmd_exec_buf(term->cmd_tree, w->line, s, term->cmdopt);
+	len = stream_ndata(s);
+	buf = malloc(len + 1);
+	lines = malloc((len + 1) * sizeof(size_t));
+	if (!buf || !lines) {
+		free(buf);
+		free(lines);
+		stream_free(s);
+		goto rearm;
+	}
+	stream_get(s, buf, len);
+	stream_free(s);
+	n = term_watch_split(buf, len, lines);
+
+	if (w->buf == NULL)
+		stream_puts(term->out, "\033[H\033[2JEvery %ds: %s\r\n",
+			    w->interval_ms / 1000, w->line);
+
+	for (i = 0; i < n; i++) {
+		if (i < w->nr_lines && !strcmp(buf + lines[i], w->buf + w->lines[i]))
+			continue;
+		stream_puts(term->out, "\033[%zu;1H%s\033[K", i + WATCH_TOP,
+			    buf + lines[i]);
+	}
+	if (n < w->nr_lines)
+		stream_puts(term->out, "\033[%zu;1H\033[J", n + WATCH_TOP);
+	stream_puts(term->out, "\033[%zu;1H", n + WATCH_TOP);
+
+	free(w->buf);
+	free(w->lines);
+	w->buf = buf;
+	w->lines = lines;
+	w->nr_lines = n;
+
+	term_kick(term);
+	/* no command resets the arena while the watch runs */
+	arena_reset(term->arena);
+rearm:
+	event_source_timer_update(w->timer, w->interval_ms);
+	return 0;
+}
+
+static void term_watch_end(struct term *term)
+{
+	struct term_watch *w = term->watch;
+
+	event_source_remove(w->timer);
+	free(w->buf);
+	free(w->lines);
+	free(w);
+	term->watch = NULL;
+}
+
+/*
+ * Run line every interval_ms until a key is pressed. Only the lines
+ * changed since the previous run are redrawn.
+ */
+int term_watch(struct term *term, const char *line, int interval_ms)
+{
+	struct term_watch *w;
+
+	if (term->loop == NULL || term->watch)
+		return -EOPNOTSUPP;
+
+	w = calloc(1, sizeof(*w));
+	if (w == NULL)
+		return -ENOMEM;
+
+	snprintf(w->line, sizeof(w->line), "%s", line);
+	w->interval_ms = interval_ms;
+	w->timer = event_loop_add_timer(term->loop, term_watch_run, term);
+	if (w->timer == NULL) {
+		free(w);
+		return -ENOMEM;
+	}
+
+	term->watch = w;
+	event_source_timer_update(w->timer, 1);
+
+	return 0;
+}
+
+static void term_job_free(struct term_job *job)
+{
+	if (job->in_source)
+		event_source_remove(job->in_source);
+	if (job->out_source)
+		event_source_remove(job->out_source);
+	if (job->pid_source)
+		event_source_remove(job->pid_source);
+	if (job->in_fd >= 0)
+		close(job->in_fd);
+	if (job->out_fd >= 0)
+		close(job->out_fd);
+	if (job->pid_fd >= 0)
+		close(job->pid_fd);
+	if (job->in)
+		stream_free(job->in);
+	free(job);
+}
+
+static void term_job_check(struct term *term)
+{
+	struct term_job *job = term->job;
+
+	if (!job->exited || job->out_fd >= 0)
+		return;
+
+	term->job = NULL;
+	term_job_free(job);
+
+	/* pick up what was left behind by a hangup */
+	if (term->source == NULL)
+		term->source = event_loop_add_fd(term->loop, term->fd, 1,
+						 EVENT_READABLE,
+						 term_handle_input, term);
+
 	term_prompt(term);
+	term_kick(term);
+}
+
+/*
+ * The hangup stays reported until the job is done, stop polling the
+ * terminal meanwhile. A peer that went away will not read the output.
+ */
+static void term_job_hangup(struct term *term)
+{
+	struct term_job *job = term->job;
+
+	if (term->ofd == term->fd && !job->killed) {
+		kill(job->pid, SIGTERM);
+		job->killed = 1;
+	}
+
+	event_source_remove(term->source);
+	term->source = NULL;
+}
+
+static void term_job_close_in(struct term_job *job)
+{
+	event_source_remove(job->in_source);
+	job->in_source = NULL;
+	close(job->in_fd);
+	job->in_fd = -1;
+}
+
+static int term_job_write(int fd, uint32_t mask, void *data)
+{
+	struct term *term = data;
+	struct term_job *job = term->job;
+
+	if (!(mask & (EVENT_HANGUP | EVENT_ERROR))) {
+		if (stream_flush(job->in, fd) < 0) {
+			if (errno == EAGAIN || errno == EINTR)
+				return 0;
+		} else if (stream_ndata(job->in)) {
+			return 0;
+		}
+	}
+
+	/* all fed, or the child stopped reading */
+	term_job_close_in(job);
+
+	return 0;
+}
+
+static int term_job_read(int fd, uint32_t mask, void *data)
+{
+	struct term *term = data;
+	struct term_job *job = term->job;
+	char buf[4096];
+	ssize_t r;
+
+	for (;;) {
+		r = read(fd, buf, sizeof(buf));
+		if (r > 0) {
+			stream_put(term->out, buf, r);
+			/* let the terminal catch up before reading more */
+			if (stream_ndata(term->out) >= TERM_JOB_HIGHWAT) {
+				event_source_fd_update(job->out_source, 0);
+				break;
+			}
+		} else if (r < 0 && errno == EINTR) {
+			continue;
+		} else if (r < 0 && errno == EAGAIN) {
+			break;
+		} else {
+			event_source_remove(job->out_source);
+			job->out_source = NULL;
+			close(job->out_fd);
+			job->out_fd = -1;
+			break;
+		}
+	}
+
+	term_kick(term);
+	term_job_check(term);
+
+	return 0;
+}
+
+static void term_job_reap(struct term *term)
+{
+	struct term_job *job = term->job;
+
+	if (waitpid(job->pid, NULL, WNOHANG) != job->pid)
+		return;
+
+	job->exited = 1;
+	event_source_remove(job->pid_source);
+	job->pid_source = NULL;
+	if (job->pid_fd >= 0) {
+		close(job->pid_fd);
+		job->pid_fd = -1;
+	}
+
+	term_job_check(term);
+}
+
+static int term_job_pidfd(int fd, uint32_t mask, void *data)
+{
+	term_job_reap(data);
+	return 0;
+}
+
+static int term_job_sigchld(int signo, void *data)
+{
+	term_job_reap(data);
+	return 0;
+}
+
+static int term_job_spawn(struct term_job *job, const char *cmd)
+{
+	char *argv[] = { "/bin/sh", "-c", (char *)cmd, NULL };
+	posix_spawn_file_actions_t actions;
+	posix_spawnattr_t attr;
+	int pin[2], pout[2];
+	sigset_t mask;
+	int ret;
+
+	if (pipe2(pin, O_CLOEXEC) < 0)
+		return -errno;
+	if (pipe2(pout, O_CLOEXEC) < 0) {
+		ret = -errno;
+		close(pin[0]);
+		close(pin[1]);
+		return ret;
+	}
+
+	posix_spawn_file_actions_init(&actions);
+	posix_spawn_file_actions_adddup2(&actions, pin[0], STDIN_FILENO);
+	posix_spawn_file_actions_adddup2(&actions, pout[1], STDOUT_FILENO);
+	posix_spawn_file_actions_adddup2(&actions, pout[1], STDERR_FILENO);
+
+	/* undo the signal setup of the event loop and the server */
+	posix_spawnattr_init(&attr);
+	sigemptyset(&mask);
+	posix_spawnattr_setsigmask(&attr, &mask);
+	sigaddset(&mask, SIGPIPE);
+	sigaddset(&mask, SIGCHLD);
+	posix_spawnattr_setsigdefault(&attr, &mask);
+	posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK |
+				 POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_USEVFORK);
+
+	ret = -posix_spawn(&job->pid, argv[0], &actions, &attr, argv, environ);
+
+	posix_spawnattr_destroy(&attr);
+	posix_spawn_file_actions_destroy(&actions);
+	close(pin[0]);
+	close(pout[1]);
+
+	if (ret < 0) {
+		close(pin[1]);
+		close(pout[0]);
+		return ret;
+	}
+
+	job->in_fd = pin[1];
+	job->out_fd = pout[0];
+	fcntl(job->in_fd, F_SETFL, O_NONBLOCK);
+	fcntl(job->out_fd, F_SETFL, O_NONBLOCK);
+
+	return 0;
+}
+
+/*
+ * Run cmd under /bin/sh with the pending output as its input. The job is
+ * driven by the event loop, so other terminals keep being served, and
+ * its output is streamed to the terminal as it comes.
+ */
+int term_pipe(struct term *term, const char *cmd)
+{
+	struct term_job *job;
+	int ret;
+
+	/* the job is driven by the loop of the terminal */
+	if (term->loop == NULL)
+		return -EOPNOTSUPP;
+
+	job = calloc(1, sizeof(*job));
+	if (job == NULL)
+		return -ENOMEM;
+
+	job->in_fd = job->out_fd = job->pid_fd = -1;
+	job->in = stream_new();
+	if (job->in == NULL) {
+		ret = -ENOMEM;
+		goto err;
+	}
+
+	ret = term_job_spawn(job, cmd);
+	if (ret < 0)
+		goto err;
+
+	stream_append(job->in, term->out);
+
+	job->in_source = event_loop_add_fd(term->loop, job->in_fd, 0,
+					   EVENT_WRITABLE, term_job_write, term);
+	job->out_source = event_loop_add_fd(term->loop, job->out_fd, 0,
+					    EVENT_READABLE, term_job_read, term);
+
+	job->pid_fd = syscall(SYS_pidfd_open, job->pid, 0);
+	if (job->pid_fd >= 0)
+		job->pid_source = event_loop_add_fd(term->loop, job->pid_fd, 0,
+						    EVENT_READABLE, term_job_pidfd, term);
+	else
+		job->pid_source = event_loop_add_signal(term->loop, SIGCHLD,
+							term_job_sigchld, term);
+
+	if (!job->in_source || !job->out_source || !job->pid_source) {
+		kill(job->pid, SIGKILL);
+		waitpid(job->pid, NULL, 0);
+		ret = -ENOMEM;
+		goto err;
+	}
+
+	term->job = job;
+	term_wait_input(term);
+
+	/* the child may already be gone before the signal source existed */
+	if (job->pid_fd < 0)
+		term_job_reap(term);
+
+	return 0;
+
+err:
+	term_job_free(job);
+	return ret;
+}
+
+/*
+ * Output and allocations of a command run by cmd_exec_buf(). They are
+ * kept for the next call unless calls nest.
+ */
+static struct {
+	struct stream *out;
+	struct arena *arena;
+	int busy;
+} exec_ctx;
+
+/*
+ * Run line against tree without a terminal: no prompt, echo or line
+ * editing, and no fd is touched. The output is appended to out, scratch
+ * receives the matched arguments and can be reused by every call. Filters
+ * only see the output of this command, shell pipes are not supported.
+ */
+int cmd_exec_buf(struct cmd_tree *tree, const char *line, struct stream *out,
+		 struct cmdopt *scratch)
+{
+	struct term term;
+	int ret;
+
+	memset(&term, 0, sizeof(term));
+	term.fd = term.ofd = -1;
+	term.name = TERM_DEFAULT_NAME;
+	term.cmd_tree = tree;
+	term.cmdopt = scratch;
+
+	if (!exec_ctx.busy && exec_ctx.out) {
+		term.out = exec_ctx.out;
+		term.arena = exec_ctx.arena;
+	} else {
+		term.out = stream_new();
+		term.arena = arena_create(TERM_ARENA_SIZE);
+		if (!term.out || !term.arena) {
+			ret = CMD_ERR_SYSTEM;
+			goto out;
+		}
+		stream_set_arena(term.out, term.arena);
+		if (!exec_ctx.busy) {
+			exec_ctx.out = term.out;
+			exec_ctx.arena = term.arena;
+		}
+	}
+
+	exec_ctx.busy++;
+	ret = cmd_execute(&term, tree, line);
+	term_more_drain(&term);
+	exec_ctx.busy--;
+
+	stream_append(out, term.out);
+	arena_reset(term.arena);
+out:
+	if (term.out != exec_ctx.out) {
+		if (term.out)
+			stream_free(term.out);
+		if (term.arena)
+			arena_destroy(term.arena);
+	}
+
+	return ret;
 }
 
 int term_print(struct term *term, const char *fmt, ...)
@@ -566,7 +1262,7 @@ int term_print(struct term *term, const char *fmt, ...)
 
 int term_flush(struct term *term)
 {
-	return stream_flush(term->out, 1);
+	return stream_flush(term->out, term->ofd);
 }
 
 static void term_redraw_line(struct term *term)
@@ -583,9 +1279,9 @@ static void term_backward_pure_word(struct term *term)
 		term_backward_char(term);
 }
 
-static void term_insert_word_overwrite(struct term *term, char *str)
+static void term_insert_word_overwrite(struct term *term, const char *str,
+				       size_t n)
 {
-	size_t n = strlen(str);
 	struct buffer *in = term->in;
 
 	if (n > in->max - in->cp - 1)
@@ -601,12 +1297,12 @@ static void term_insert_word_overwrite(struct term *term, char *str)
 static void term_complete_command(struct term *term)
 {
 	int ret;
-	int num = 0;
-	char **keys = NULL;
+	int num = 0, lcp = 0;
+	const char *const *keys = NULL;
 
 	stream_puts(term->out, "\r\n");
 
-	ret = cmd_complete(term->cmd_tree, term->in->buf, &num, &keys);
+	ret = cmd_complete(cmd_tree_update(&term->cmd_tree), term->in->buf, &num, &keys, &lcp);
 	if (ret == CMD_ERR_NO_MATCH) {
 		stream_puts(term->out, "%% No matched command.\r\n");
 		term_prompt(term);
@@ -615,15 +1311,13 @@ static void term_complete_command(struct term *term)
 		term_prompt(term);
 		term_redraw_line(term);
 		term_backward_pure_word(term);
-		term_insert_word_overwrite(term, keys[0]);
+		term_insert_word_overwrite(term, keys[0], strlen(keys[0]));
 		term_self_insert(term, ' ');
-		cmd_complete_free(ret, keys);
 	} else if (ret == CMD_COMPLETE_MATCH) {
 		term_prompt(term);
 		term_redraw_line(term);
 		term_backward_pure_word(term);
-		term_insert_word_overwrite(term, keys[0]);
-		cmd_complete_free(ret, keys);
+		term_insert_word_overwrite(term, keys[0], lcp);
 	} else if (ret == CMD_COMPLETE_LIST_MATCH) {
 		int i;
 		for (i = 0; i < num; i++) {
@@ -634,11 +1328,12 @@ static void term_complete_command(struct term *term)
 		stream_puts(term->out, "\r\n");
 		term_prompt(term);
 		term_redraw_line(term);
-		cmd_complete_free(ret, keys);
 	} else {
 		term_prompt(term);
 		term_redraw_line(term);
 	}
+
+	arena_reset(term->arena);
 }
 
 static void term_describe_command(struct term *term)
@@ -646,7 +1341,8 @@ static void term_describe_command(struct term *term)
 	int ret, num = 0, cr = 0;
 	char **keys = NULL, **descs = NULL;
 
-	ret = cmd_describe(term->cmd_tree, term->in->buf, &num, &keys, &descs, &cr);
+	ret = cmd_describe(cmd_tree_update(&term->cmd_tree), term->arena, term->in->buf, &num,
+			   &keys, &descs, &cr);
 
 	stream_puts(term->out, "\r\n");
 
@@ -675,9 +1371,9 @@ static void term_describe_command(struct term *term)
 	}
 
 out:
-	cmd_describe_free(ret, keys, descs);
 	term_prompt(term);
 	term_redraw_line(term);
+	arena_reset(term->arena);
 }
 
 static void term_beginning_of_line(struct term *term)
@@ -800,6 +1496,20 @@ static void term_previous_line(struct term *term)
 
 static void term_read(struct term *term, int c)
 {
+	if (term->pager) {
+		term_pager_key(term, c);
+		return;
+	}
+
+	/* any key ends a watch */
+	if (term->watch) {
+		term_watch_end(term);
+		stream_puts(term->out, "\r\n");
+		term_prompt(term);
+		arena_reset(term->arena);
+		return;
+	}
+
 	if (term->escape == TERM_ESCAPE) {
 		if (c == 'A') {
 			term_previous_line(term);
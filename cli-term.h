@@ -26,6 +26,7 @@
 #define __CLI_TERM_H__
 
 #include <stddef.h>
+#include <stdint.h>
 
 #define CMD_SUCCESS              0
 #define CMD_WARNING              1
@@ -42,13 +43,64 @@
 
 struct term;
 struct stream;
+struct arena;
 
 #define MAXARGC	64
+#define CMD_LINE_MAX	8192
+#define CMD_MAXSLOTS	32
 
+enum cmd_value_type {
+	CMD_VALUE_NONE,
+	CMD_VALUE_FLAG,
+	CMD_VALUE_STRING,
+	CMD_VALUE_INT,
+	CMD_VALUE_UINT,
+	CMD_VALUE_RANGE,
+	CMD_VALUE_IPV4,
+	CMD_VALUE_MAC,
+};
+
+struct cmd_range {
+	int start;
+	int end;
+};
+
+/*
+ * Typed placeholders (INT, UINT, HEX, HEX8, HEX16, HEX32, RANGE, IPV4,
+ * MAC, IFNAME, optionally bounded as in INT<0-31>) are converted once
+ * while matching. An optattr without set() gets the value stored as is:
+ * int, unsigned int, uint8_t/uint16_t/uint32_t for HEXn, struct
+ * cmd_range, struct in_addr, uint8_t[6], bool for a bare keyword and a
+ * string pointer for anything else.
+ */
+struct cmd_value {
+	uint8_t type;
+	uint8_t size;
+	union {
+		long long i;
+		unsigned long long u;
+		struct cmd_range range;
+		uint32_t ipv4;
+		uint8_t mac[6];
+		const char *str;
+	} v;
+};
+
+/*
+ * Keywords on the path of a command are numbered when the tree is built,
+ * the matcher stores a matched keyword and its value in that slot.
+ */
 struct cmdopt {
 	char *argv[MAXARGC];
+	struct cmd_value argval[MAXARGC];
 	int argc;
-	struct hashtable *kpairs;
+
+	const char *keys[CMD_MAXSLOTS];
+	const char *values[CMD_MAXSLOTS];
+	struct cmd_value slotval[CMD_MAXSLOTS];
+	uint32_t slotmask;
+
+	const char *pipe;	/* "| ..." following the command, or NULL */
 };
 
 struct optattr {
@@ -69,57 +121,143 @@ struct cmdoptattr {
 	void (*init)(void *buf, size_t size);
 };
 
+/*
+ * Elems are laid out as an array in cmd_section, the alignment keeps the
+ * size a multiple of what the compiler aligns such objects to.
+ */
 struct cmd_elem {
 	const char *line;
 	const char *desc;
 	int (*func)(struct term *term, struct cmdopt *opt);
 	struct cmdoptattr *optattr;
-} __attribute__((aligned(16)));
+	unsigned int cache_ms;	/* output reused for as long, 0 if never */
+} __attribute__((aligned(32)));
 
 struct cmdopt *cmdopt_create(void);
 void cmdopt_clear(struct cmdopt *opt);
 void cmdopt_destroy(struct cmdopt *opt);
 
+int set_strptr(const char *src, void *dst);
+int set_i32(const char *src, void *dst);
+int set_bool(const char *src, void *dst);
+
 #define COMMAND(func, attr, line, desc)					\
+	COMMAND_CACHED(func, attr, 0, line, desc)
+
+/*
+ * The output of a successful run is kept for ttl_ms and served to any
+ * run with the same arguments meanwhile, without calling func. Only for
+ * commands that change nothing and do not page their output.
+ */
+#define COMMAND_CACHED(func, attr, ttl_ms, line, desc)			\
 	static int func(struct term *term, struct cmdopt *opt);		\
 									\
 	struct cmd_elem cmd_sec_##func					\
 		__attribute__ ((used, section("cmd_section"))) = {	\
-		line, desc, func, attr					\
+		line, desc, func, attr, ttl_ms				\
 	};								\
 									\
 	static int func(struct term *term, struct cmdopt *opt)
 
+/*
+ * Once in a shared object loaded by cmd_plugin_load(): exports the bounds
+ * of its own cmd_section, the linker defines them only if referenced.
+ */
+#define CMD_PLUGIN()							\
+	extern const struct cmd_elem __start_cmd_section[]		\
+		__attribute__ ((visibility("hidden")));			\
+	extern const struct cmd_elem __stop_cmd_section[]		\
+		__attribute__ ((visibility("hidden")));			\
+									\
+	const struct cmd_elem *cmd_plugin_elems(const struct cmd_elem **end) \
+	{								\
+		*end = __stop_cmd_section;				\
+		return __start_cmd_section;				\
+	}
+
 struct event_loop;
 
-struct cmd_node *cmd_tree_build(const struct cmd_elem *start, const struct cmd_elem *end);
-struct cmd_node *cmd_tree_build_default(void);
-void cmd_tree_delete(struct cmd_node *tree);
-int cmd_execute(struct term *term, struct cmd_node *tree, const char *line);
+struct cmd_tree *cmd_tree_build(const struct cmd_elem *start, const struct cmd_elem *end);
+struct cmd_tree *cmd_tree_get_default(void);
+int cmd_tree_save(struct cmd_tree *tree, const char *path);
+int cmd_tree_emit(struct cmd_tree *tree, const char *path);
+struct cmd_tree *cmd_tree_load(const char *path, const struct cmd_elem *start,
+			       const struct cmd_elem *end);
+void cmd_tree_set_image(const char *path);
+int cmd_tree_reload(void);
+struct cmd_tree *cmd_tree_update(struct cmd_tree **tree);
+int cmd_register(const char *name, const struct cmd_elem *start,
+		 const struct cmd_elem *end);
+int cmd_unregister(const char *name);
+int cmd_plugin_load(const char *path, char *err, size_t size);
+int cmd_plugin_unload(const char *path);
+void cmd_modules_show(struct stream *out);
+struct cmd_tree *cmd_tree_get(struct cmd_tree *tree);
+void cmd_tree_put(struct cmd_tree *tree);
+int cmd_tree_refcnt(struct cmd_tree *tree);
+int cmd_execute(struct term *term, struct cmd_tree *tree, const char *line);
+
+int cmd_list_elems(struct term *term);
+
+int cmd_complete(struct cmd_tree *tree, const char *line, int *n,
+		 const char *const **keys, int *lcp);
+int cmd_describe(struct cmd_tree *tree, struct arena *arena, const char *line,
+		 int *n, char ***keys, char ***descs, int *cr);
+int cmd_exec_buf(struct cmd_tree *tree, const char *line, struct stream *out,
+		 struct cmdopt *scratch);
 
-void cmd_list_elems(struct stream *out);
-void cmd_tree_show(struct stream *stream, struct cmd_node *tree);
+#define CMD_SOURCE_CONTINUE	0x1	/* go on after a failing line */
 
-int cmd_complete(struct cmd_node *tree, const char *line, int *n, char ***keys);
-void cmd_complete_free(int ret, char **keys);
-int cmd_describe(struct cmd_node *tree, const char *line, int *n,
-		 char ***keys, char ***descs, int *cr);
-void cmd_describe_free(int ret, char **keys, char **descs);
-void cmd_tree_travel(struct cmd_node *tree, struct stream *out);
+struct cmd_source_stats {
+	unsigned long lines;
+	unsigned long commands;
+	unsigned long failed;
+	double seconds;
+};
+
+int cmd_source(struct cmd_tree *tree, const char *path, int flags,
+	       struct stream *out, int fd, struct cmd_source_stats *st);
+void cmd_tree_travel(struct cmd_tree *tree, struct stream *out);
+void cmd_stats_show(struct cmd_tree *tree, struct stream *out);
+void cmd_stats_reset(struct cmd_tree *tree);
 
 int term_fd(struct term *term);
+int term_ofd(struct term *term);
 struct term *term_create(struct event_loop *loop, int fd, const char *name);
 void term_destroy(struct term *term);
 void term_run(struct term *term);
 int term_want_exit(struct term *term);
 
+struct machine;
+
+struct machine *machine_create(struct event_loop *loop, int fd);
+void machine_destroy(struct machine *m);
+int machine_fd(struct machine *m);
+int machine_want_exit(struct machine *m);
+
 struct cmdopt *term_cmdopt(struct term *term);
 struct stream *term_ostream(struct term *term);
-struct cmd_node *term_cmd_tree(struct term *term);
+struct arena *term_arena(struct term *term);
+struct cmd_tree *term_cmd_tree(struct term *term);
 
 void term_quit(struct term *term);
 int term_print(struct term *term, const char *fmt, ...);
 int term_flush(struct term *term);
+int term_pipe(struct term *term, const char *cmd);
+int term_watch(struct term *term, const char *line, int interval_ms);
+
+/*
+ * Output generator of a paged command, called for more output while the
+ * page is not full. It returns 1 if there is more to come, 0 when done or
+ * a negative value on error. release() is called once it is done or the
+ * user quits at --More--.
+ */
+typedef int (*term_more_fn)(struct term *term, void *data);
+
+int term_more(struct term *term, term_more_fn fn, void *data,
+	      void (*release)(void *data));
+void term_more_drain(struct term *term);
+void term_set_length(struct term *term, int lines);
 void term_show_history(struct term *term);
 
 #endif
@@ -25,19 +25,36 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <stdbool.h>
 #include <string.h>
 #include <ctype.h>
+#include <dlfcn.h>
 #include <errno.h>
+#include <limits.h>
+#include <time.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/wait.h>
+#include <arpa/inet.h>
+#include <net/if.h>
 
 #include "cli-term.h"
 #include "stream.h"
-#include "hashtable.h"
+#include "arena.h"
+#include "filter.h"
+#include "output-cache.h"
 
 #include "libregexp.h"
 
+#define CMD_NOSLOT	0xff
+
+#ifndef ARRAY_SIZE
+#define ARRAY_SIZE(arr)	sizeof(arr) / sizeof(arr[0])
+#endif
+
 enum token_type {
 	TOKEN_LITERAL,
 	TOKEN_OPTION,
@@ -45,12 +62,22 @@ enum token_type {
 	TOKEN_VARARG,
 };
 
+/* key and desc are atoms: equal strings have the same strtab offset */
 struct token {
-	char *key;
-	char *desc;
+	uint32_t key;
+	uint32_t desc;
 	int type;
+	int vtype;		/* resolved bound of a variable, see ctoken */
+	long long min, max;
 };
 
+/*
+ * The command syntax is parsed into a linked tree of cmd_node, which is
+ * only used while building. cmd_tree_build() then compiles it into flat
+ * arrays (struct cnode/ctoken) where the children of every node form a
+ * contiguous span and literal tokens of a span are found through a hash
+ * index, so matching a word does not depend on the number of siblings.
+ */
 struct cmd_node {
 	struct cmd_node *sibling;
 	struct cmd_node *children;
@@ -60,12 +87,151 @@ struct cmd_node {
 	size_t nr_tokens;
 
 	struct cmd_node *keyword;
-	struct cmdoptattr *optattr;
+	int elem;
+	uint32_t group;		/* stub of a lazy group, index + 1 */
+};
+
+struct ctoken {
+	uint32_t key;		/* offset in strtab */
+	uint32_t desc;		/* offset in strtab */
+	uint32_t hash;
+	uint16_t type;
+	uint16_t vtype;		/* var_types index + 1, 0 if untyped */
+	long long min, max;
+};
+
+struct cspan {
+	uint32_t node;		/* first node */
+	uint32_t count;
+	uint32_t index;		/* hash index of literal tokens */
+	uint32_t size;		/* power of 2, 0 if no literal */
+	uint32_t wild;		/* non-literal tokens, best match first */
+	uint32_t nr_wild;
+};
+
+struct cnode {
+	uint32_t parent;
+	uint32_t token;
+	uint32_t nr_tokens;
+	int32_t elem;		/* index in elems, -1 if not executable */
+
+	/*
+	 * A keyword node owns this option slot, other nodes number their
+	 * keywords from here. bind locates the slot of every attr of the
+	 * elem's cmdoptattr in tree->binds.
+	 */
+	uint32_t slot;
+	uint32_t bind;
+
+	struct cspan children;
+	struct cspan keyword;
+
+	/* sorted keys of both spans in tree->comp and their radix tree */
+	uint32_t comp;
+	uint32_t nr_comp;
+	uint32_t radix;
+
+	uint32_t group;		/* lazy group + 1 while not parsed */
+};
+
+#define STAT_BUCKETS	40	/* latency up to 2^39 ns */
+#define STAT_CODES	16	/* CMD_* codes, the last one counts the others */
 
-	int (*func)(struct term *term, struct cmdopt *opt);
+/*
+ * Execution statistics of a cmd_elem. Latencies are counted in buckets of
+ * powers of 2 nanoseconds, so percentiles are reported as bucket bounds.
+ */
+struct cmd_stat {
+	uint64_t calls;
+	uint64_t bytes;
+	uint64_t max_ns;
+	uint64_t errors[STAT_CODES];
+	uint32_t hist[STAT_BUCKETS];
+};
+
+/*
+ * Elems whose line starts with the same literal, parsed under the node of
+ * that literal when a command line first walks into it.
+ */
+struct cgroup {
+	const char *word;	/* in the line of the first elem */
+	uint32_t len;
+	uint32_t node;
+	uint32_t first;		/* in tree->group_elems */
+	uint32_t nr_elems;
+};
+
+/* node 0 is the root which is never a child, so it marks an empty entry */
+struct centry {
+	uint32_t node;
+	uint32_t token;
+};
+
+/*
+ * Every radix node covers the run comp[lo, hi) of the keys sharing their
+ * first depth chars, its children are contiguous and split the run by the
+ * char at depth. A prefix thus selects a run for completion, and counting
+ * the literals of the run resolves an abbreviation.
+ */
+struct cradix {
+	uint32_t lo, hi;
+	uint32_t depth;
+	uint32_t child;
+	uint32_t nr_child;
+	uint32_t nr_lit[2];	/* distinct literals of children/keyword span */
+	struct centry lit[2];	/* the literal when there is only one */
+};
+
+/*
+ * A built command tree only changes by parsing its groups on demand, which
+ * leaves the commands it matches as they are, so one instance is shared by
+ * every terminal and released by the last cmd_tree_put().
+ */
+struct cmd_tree {
+	int refcnt;
+	uint32_t version;	/* of the default tree, 0 for any other */
+
+	struct cmd_module **mods;	/* the elems come from, referenced */
+	size_t nr_mods;
+
+	const struct cmd_elem **elems;
+	struct cmd_stat *stats;
+	size_t nr_elems;
+
+	struct cnode *nodes;
+	uint32_t nr_nodes;
+	struct ctoken *tokens;
+	uint32_t nr_tokens;
+	struct centry *index;
+	uint32_t nr_index;
+	uint8_t *binds;
+	uint32_t nr_binds;
+	uint32_t *comp;		/* offsets in strtab */
+	const char **comp_keys;	/* comp as pointers, built on first use */
+	uint32_t nr_comp;
+	struct cradix *radix;
+	uint32_t nr_radix;
+	char *strtab;
+	uint32_t strtab_len;
+
+	void *image;		/* the arrays above point into it if mapped */
+	size_t image_size;	/* of the mapping, 0 if embedded */
+
+	/*
+	 * The arrays are allocated for all groups at once, so parsing one
+	 * later only appends and never moves what is referenced already.
+	 */
+	struct cgroup *groups;
+	uint32_t nr_groups;
+	uint32_t nr_parsed;
+	uint32_t *group_elems;
+	struct compiler *compiler;	/* kept until every group is parsed */
+	uint64_t build_ns;
+	uint64_t lazy_ns;
 };
 
 struct parser_state {
+	struct compiler *c;
 	const char *cp;
 	const char *desc;
 
@@ -76,7 +242,7 @@ struct parser_state {
 
 	struct token *token;
 	size_t token_count;
-	const struct cmd_elem *elem;
+	int elem;
 	struct cmd_node *parent;
 	struct cmd_node *save_parent;
 };
@@ -87,9 +253,84 @@ struct parser_state {
 #define for_each_token(node, i, token)	\
 	for (token = node->tokens, i = 0; i < node->nr_tokens; i++, token++)
 
-#define for_each_node_token(head, node, i, token)	\
-	for_each_node(node, head) 			\
-	for_each_token(node, i, token)
+#define for_each_span_node(tree, span, pos)				\
+	for (pos = &(tree)->nodes[(span)->node];			\
+	     pos < &(tree)->nodes[(span)->node + (span)->count]; pos++)
+
+#define for_each_cnode_token(tree, node, token)				\
+	for (token = &(tree)->tokens[(node)->token];			\
+	     token < &(tree)->tokens[(node)->token + (node)->nr_tokens]; token++)
+
+static inline const char *tree_str(struct cmd_tree *tree, uint32_t off)
+{
+	return tree->strtab + off;
+}
+
+static inline struct cnode *tree_root(struct cmd_tree *tree)
+{
+	return &tree->nodes[0];
+}
+
+static void tree_expand_all(struct cmd_tree *tree);
+static void tree_prepare(struct cmd_tree *tree, const char *word);
+
+static uint32_t string_hash(const char *str)
+{
+	uint32_t hash = 0;
+
+	for (; *str; str++)
+		hash = hash * 31 + *str;
+
+	return hash;
+}
+
+static uint32_t string_hash_n(const char *str, size_t len)
+{
+	uint32_t hash = 0;
+
+	while (len--)
+		hash = hash * 31 + *str++;
+
+	return hash;
+}
+
+struct compiler {
+	struct cmd_tree *tree;
+	uint32_t strtab_alloc;
+	uint32_t *strings;	/* strtab offset + 1 */
+	uint32_t nr_strings;
+	uint32_t nr_index_alloc;
+};
+
+/*
+ * Intern len chars of str in the strtab and return the offset, the atom
+ * of the string. The strtab is allocated for all elems of the tree, so
+ * atoms stay valid as pointers too. Returns 0, the empty string, if full.
+ */
+static uint32_t compile_strn(struct compiler *c, const char *str, size_t len)
+{
+	struct cmd_tree *tree = c->tree;
+	uint32_t i, off;
+	uint32_t mask = c->nr_strings - 1;
+
+	for (i = string_hash_n(str, len) & mask; c->strings[i]; i = (i + 1) & mask) {
+		off = c->strings[i] - 1;
+		if (strncmp(tree->strtab + off, str, len) == 0 &&
+		    tree->strtab[off + len] == '\0')
+			return off;
+	}
+
+	if (tree->strtab_len + len + 1 > c->strtab_alloc)
+		return 0;
+
+	off = tree->strtab_len;
+	memcpy(tree->strtab + off, str, len);
+	tree->strtab[off + len] = '\0';
+	tree->strtab_len += len + 1;
+	c->strings[i] = off + 1;
+
+	return off;
+}
 
 static const char *next_key(const char **endptr)
 {
@@ -143,7 +384,7 @@ static struct cmd_node *cmd_node_find(struct cmd_node *parent,
 	struct cmd_node *node;
 
 	if (count == 1) {
-		const char *key = token->key;
+		uint32_t key = token->key;
 
 		if (ret)
 			*ret = 1;
@@ -151,7 +392,7 @@ static struct cmd_node *cmd_node_find(struct cmd_node *parent,
 			int i;
 
 			for (i = 0; i < node->nr_tokens; i++) {
-				if (!strcmp(key, node->tokens[i].key))
+				if (key == node->tokens[i].key)
 					return node;
 			}
 		}
@@ -167,9 +408,9 @@ static struct cmd_node *cmd_node_find(struct cmd_node *parent,
 
 			found = 0;
 			for (c = 0; c < count; c++) {
-				const char *key = token[c].key;
+				uint32_t key = token[c].key;
 				for (i = 0; i < node->nr_tokens; i++) {
-					if (!strcmp(key, node->tokens[i].key)) {
+					if (key == node->tokens[i].key) {
 						found++;
 						break;
 					}
@@ -200,6 +441,7 @@ static struct cmd_node *cmd_node_new(struct token *token, size_t count)
 
 	node->tokens = token;
 	node->nr_tokens = count;
+	node->elem = -1;
 
 	return node;
 }
@@ -219,7 +461,9 @@ static void cmd_node_insert(struct cmd_node *parent, struct cmd_node *new, int k
 	new->parent = parent;
 }
 
-static int token_record(struct token *token,
+static int compile_vtype(struct ctoken *ct, const char *key);
+
+static int token_record(struct compiler *c, struct token *token,
 			const char *cp, const char *cp_end,
 			const char *dp, const char *dp_end)
 {
@@ -236,18 +480,27 @@ static int token_record(struct token *token,
 		token->type = TOKEN_LITERAL;
 	}
 
-	token->key = malloc(cp_len + 1);
-	if (token->key == NULL)
-		return -ENOMEM;
-	token->desc = malloc(dp_len + 1);
-	if (token->desc == NULL)
+	token->key = compile_strn(c, cp, cp_len);
+	token->desc = compile_strn(c, dp, dp_len);
+	if ((cp_len && !token->key) || (dp_len && !token->desc))
 		return -ENOMEM;
 
-	memcpy(token->key, cp, cp_len);
-	token->key[cp_len] = '\0';
+	token->vtype = 0;
+
+	/* a bad bound rejects the command rather than match any word */
+	if (token->type == TOKEN_VARIABLE) {
+		const char *key = tree_str(c->tree, token->key);
+		struct ctoken ct = { .vtype = 0 };
+
+		if (compile_vtype(&ct, key) < 0) {
+			printf("invalid bound in '%s'\r\n", key);
+			return -EINVAL;
+		}
 
-	memcpy(token->desc, dp, dp_len);
-	token->desc[dp_len] = '\0';
+		token->vtype = ct.vtype;
+		token->min = ct.min;
+		token->max = ct.max;
+	}
 
 	return 0;
 }
@@ -257,6 +510,7 @@ static int parser_read_word(struct parser_state *state)
 	const char *start;
 	const char *line;
 	struct cmd_node *new;
+	int ret;
 
 	start = state->cp;
 
@@ -275,13 +529,15 @@ static int parser_read_word(struct parser_state *state)
 		if (token == NULL)
 			return -ENOMEM;
 
-		if (token_record(token, start, state->cp, line, state->desc))
-			return -ENOMEM;
+		ret = token_record(state->c, token, start, state->cp, line,
+				   state->desc);
+		if (ret < 0) {
+			free(token);
+			return ret;
+		}
 
 		new = cmd_node_find(state->parent, token, 1, NULL);
 		if (new) {
-			free(token->key);
-			free(token->desc);
 			free(token);
 			state->parent = new;
 		} else {
@@ -308,18 +564,13 @@ static int parser_read_word(struct parser_state *state)
 
 		state->token_count++;
 
-		if (token_record(&state->token[index], start, state->cp,
-				 line, state->desc)) {
-			int i;
-
-			for (i = 0; i < index; i++) {
-				free(state->token[i].key);
-				free(state->token[i].desc);
-			}
+		ret = token_record(state->c, &state->token[index], start,
+				   state->cp, line, state->desc);
+		if (ret < 0) {
 			free(state->token);
 			state->token = NULL;
 			state->token_count = 0;
-			return -ENOMEM;
+			return ret;
 		}
 	}
 
@@ -359,15 +610,9 @@ static int parser_end_multiple(struct parser_state *state)
 	new = cmd_node_find(state->parent, state->token,
 			    state->token_count, &ret);
 	if (new) {
-		int i;
-
 		if (ret != state->token_count)
 			return -EINVAL;
 
-		for (i = 0; i < state->token_count; i++) {
-			free(state->token[i].key);
-			free(state->token[i].desc);
-		}
 		free(state->token);
 	} else {
 		new = cmd_node_new(state->token, state->token_count);
@@ -432,25 +677,24 @@ static int parser_end(struct parser_state *state)
 	if (state->in_multiple || state->in_keyword)
 		return -EINVAL;
 
-	state->parent->func = state->elem->func;
-	state->parent->optattr = state->elem->optattr;
-	if (state->parent->tokens[0].type == TOKEN_VARARG) {
-		state->parent->parent->func = state->elem->func;
-		state->parent->parent->optattr = state->elem->optattr;
-	}
+	state->parent->elem = state->elem;
+	if (state->parent->tokens[0].type == TOKEN_VARARG)
+		state->parent->parent->elem = state->elem;
 
 	return 0;
 }
 
-static int cmd_add_elem(struct cmd_node *tree, const struct cmd_elem *elem)
+static int cmd_add_elem(struct compiler *c, struct cmd_node *tree,
+			const struct cmd_elem *elem, int index)
 {
 	struct parser_state state;
 	int ret;
 
 	memset(&state, 0, sizeof(struct parser_state));
+	state.c = c;
 	state.cp = elem->line;
 	state.desc = elem->desc;
-	state.elem = elem;
+	state.elem = index;
 	state.parent = tree;
 
 	for (;;) {
@@ -489,12 +733,6 @@ static int cmd_add_elem(struct cmd_node *tree, const struct cmd_elem *elem)
 
 static void free_node(struct cmd_node *node)
 {
-	int i;
-
-	for (i = 0; i < node->nr_tokens; i++) {
-		free(node->tokens[i].key);
-		free(node->tokens[i].desc);
-	}
 	if (node->tokens)
 		free(node->tokens);
 
@@ -506,17 +744,16 @@ struct ls {
 	int more[32];
 };
 
-void _cmd_tree_dump(struct cmd_node *tree, struct stream *out,
-			struct ls *ls, int level, int first, int last, int opt)
+static void _cmd_tree_dump(struct cmd_tree *tree, struct cnode *cnode,
+			   struct stream *out, struct ls *ls, int level,
+			   int first, int last, int opt)
 {
 	int i;
-	struct cmd_node *node;
+	struct cnode *node;
+	struct ctoken *token;
 	int len = 0;
 	int count = 0;
 
-	if (!tree)
-		return;
-
 	if (!first) {
 		for (i = 0; i < level; i++) {
 			int m;
@@ -544,80 +781,91 @@ void _cmd_tree_dump(struct cmd_node *tree, struct stream *out,
 		ls->width[0] = 3;
 		ls->more[0] = 0;
 	} else {
-		int m;
-		struct token *token;
-
-		for_each_token(tree, m, token) {
-			if (m == 0)
-				if (tree->func) {
-					// len = strlen(token->key);
-					// stream_puts(out, "%s%c%s%s", "\x1b[34;1m", token->key[0], "\x1b[0m", token->key+1);
-					len += stream_puts(out, "%s", token->key);
-				} else
-					len += stream_puts(out, "%s", token->key);
+		for_each_cnode_token(tree, cnode, token) {
+			if (token == &tree->tokens[cnode->token])
+				len += stream_puts(out, "%s", tree_str(tree, token->key));
 			else
-				len += stream_puts(out, "|%s", token->key);
+				len += stream_puts(out, "|%s", tree_str(tree, token->key));
 		}
 	}
 
 	ls->width[level] = len;
-	if (tree->parent && tree->parent->keyword) {
+	if (level && tree->nodes[cnode->parent].keyword.count)
 		ls->more[level] = 1;
-	} else
+	else
 		ls->more[level] = !last;
 
-	if (tree->children == NULL && tree->keyword == NULL)
+	if (cnode->children.count == 0 && cnode->keyword.count == 0)
 		stream_puts(out, "\r\n");
 
-	for_each_node(node, tree->children) {
+	for_each_span_node(tree, &cnode->children, node) {
+		struct cnode *head = &tree->nodes[cnode->children.node];
+		struct cnode *tail = head + cnode->children.count - 1;
+
 		count++;
-		if (node == tree->children) {
-			if (node->sibling)
+		if (node == head) {
+			if (node != tail)
 				stream_puts(out, "-+-");
 			else
 				stream_puts(out, "---");
 		}
-		_cmd_tree_dump(node, out, ls, level + 1, node == tree->children, node->sibling == NULL, 0);
+		_cmd_tree_dump(tree, node, out, ls, level + 1, node == head, node == tail, 0);
 	}
 
-	for_each_node(node, tree->keyword) {
-		if (count == 0 && node == tree->keyword) {
+	for_each_span_node(tree, &cnode->keyword, node) {
+		struct cnode *head = &tree->nodes[cnode->keyword.node];
+		struct cnode *tail = head + cnode->keyword.count - 1;
+
+		if (count == 0 && node == head) {
 			stream_puts(out, "-*-");
 		}
 
-		_cmd_tree_dump(node, out, ls, level + 1, count ? 0 : node == tree->keyword, node->sibling == NULL, 1);
+		_cmd_tree_dump(tree, node, out, ls, level + 1, count ? 0 : node == head, node == tail, 1);
 	}
 }
 
-void cmd_tree_travel(struct cmd_node *tree, struct stream *out)
+/* the dump parses every group, the parse time then covers all of them */
+void cmd_tree_travel(struct cmd_tree *tree, struct stream *out)
 {
 	struct ls ls;
 
-	_cmd_tree_dump(tree, out, &ls, 0, 1, 1, 0);
+	tree_expand_all(tree);
+
+	stream_puts(out, "%zu commands, %u nodes, %u groups parsed on demand\r\n",
+		    tree->nr_elems, tree->nr_nodes, tree->nr_parsed);
+	if (tree->image)
+		stream_puts(out, "mapped from an image, not parsed\r\n");
+	else
+		stream_puts(out, "parse time %.1f us at build, %.1f us on demand\r\n",
+			    tree->build_ns / 1000.0, tree->lazy_ns / 1000.0);
+
+	_cmd_tree_dump(tree, tree_root(tree), out, &ls, 0, 1, 1, 0);
 }
 
-void cmd_tree_delete(struct cmd_node *tree)
+static void cmd_node_delete(struct cmd_node *node)
 {
-	if (tree->children)
-		cmd_tree_delete(tree->children);
-	if (tree->sibling)
-		cmd_tree_delete(tree->sibling);
-	if (tree->keyword)
-		cmd_tree_delete(tree->keyword);
-
-	free_node(tree);
+	if (node->children)
+		cmd_node_delete(node->children);
+	if (node->sibling)
+		cmd_node_delete(node->sibling);
+	if (node->keyword)
+		cmd_node_delete(node->keyword);
+
+	free_node(node);
 }
 
-static size_t token_count(struct cmd_node *head, const char *str, size_t len)
+static size_t token_count(struct cmd_tree *tree, struct cspan *span,
+			  const char *str, size_t len)
 {
-	int i;
-	struct token *token;
-	struct cmd_node *node;
+	struct cnode *node;
+	struct ctoken *token;
 	size_t count = 0;
 
-	for_each_node_token(head, node, i, token) {
-		if (!len || strncmp(token->key, str, len) == 0)
-			count++;
+	for_each_span_node(tree, span, node) {
+		for_each_cnode_token(tree, node, token) {
+			if (!len || strncmp(tree_str(tree, token->key), str, len) == 0)
+				count++;
+		}
 	}
 
 	return count;
@@ -627,342 +875,991 @@ enum match_type {
 	no_match,
 	extend_match,
 	vararg_match,
+	typed_match,
 	exact_match
 };
 
-static int match_word(struct token *token, const char *word)
+static int parse_number(const char *word, int base, bool sign, long long *val)
 {
-	if (token->type == TOKEN_LITERAL) {
-		if (!strcmp(token->key, word))
-			return exact_match;
-	} else if (token->type == TOKEN_VARIABLE || token->type == TOKEN_OPTION)
-		return extend_match;
-	else if (token->type == TOKEN_VARARG)
-		return vararg_match;
+	char *end;
 
-	return no_match;
+	errno = 0;
+	if (sign) {
+		*val = strtoll(word, &end, base);
+	} else {
+		if (*word == '-')
+			return -1;
+		*val = strtoull(word, &end, base);
+	}
+
+	if (errno || end == word || *end)
+		return -1;
+
+	return 0;
 }
 
-static struct cmd_node *find_best_node(struct cmd_node *head,
-				       const char *word, struct token **ret,
-				       int *ret_node_pos)
-{
-	int i, pos = 0;
-	int match, best_match = no_match;
-	struct token *token, *target_token = NULL;
-	struct cmd_node *node, *target_node = NULL;
-	int target_node_pos = 0;
-
-	for_each_node(node, head) {
-		for_each_token(node, i, token) {
-			match = match_word(token, word);
-			if (best_match < match) {
-				best_match = match;
-				target_node = node;
-				target_token = token;
-				target_node_pos = pos;
-			}
-		}
-		pos++;
-	}
+static int parse_int(const char *word, struct ctoken *token, struct cmd_value *val)
+{
+	if (parse_number(word, 0, true, &val->v.i) < 0)
+		return -1;
 
-	if (target_token) {
-		if (ret)
-			*ret = target_token;
-		if (ret_node_pos)
-			*ret_node_pos = target_node_pos;
-	}
+	return val->v.i < token->min || val->v.i > token->max ? -1 : 0;
+}
+
+static int parse_uint(const char *word, struct ctoken *token, struct cmd_value *val)
+{
+	long long v;
+
+	if (parse_number(word, 0, false, &v) < 0)
+		return -1;
 
-	return target_node;
+	val->v.u = v;
+	return val->v.u < token->min || val->v.u > token->max ? -1 : 0;
 }
 
-int cmd_search(struct cmd_node *head, struct cmd_node **ret, int wordc,
-	       char **words, int *wordi, int argc, char **argv, int *argi,
-	       struct hashtable *h)
+static int parse_hex(const char *word, struct ctoken *token, struct cmd_value *val)
 {
-	struct token *token = NULL;
-	struct cmd_node *target = NULL;
+	long long v;
 
-	target = find_best_node(head, words[*wordi], &token, NULL);
-	if (target == NULL)
-		return CMD_ERR_NO_MATCH;
+	if (word[0] == '0' && (word[1] == 'x' || word[1] == 'X'))
+		word += 2;
+	if (!isxdigit(*word) || parse_number(word, 16, false, &v) < 0)
+		return -1;
 
-	*ret = target;
-
-	if (target->nr_tokens > 1) {
-		argv[*argi] = words[*wordi];
-		++(*argi);
-		++(*wordi);
-	} else if (token->type != TOKEN_LITERAL) {
-		argv[*argi] = words[*wordi];
-		++(*argi);
-		++(*wordi);
-
-		if (token->type == TOKEN_VARARG) {
-			while (*wordi < wordc) {
-				argv[*argi] = words[*wordi];
-				++(*argi);
-				++(*wordi);
-			}
-		}
-	} else {
-		++(*wordi);
+	val->v.u = v;
+	return val->v.u < token->min || val->v.u > token->max ? -1 : 0;
+}
+
+/* N or N-M */
+static int parse_range(const char *word, struct ctoken *token, struct cmd_value *val)
+{
+	long long start, end;
+	char *ptr;
+
+	if (!isdigit(*word))
+		return -1;
+
+	errno = 0;
+	start = end = strtoll(word, &ptr, 10);
+	if (*ptr == '-') {
+		word = ptr + 1;
+		if (!isdigit(*word))
+			return -1;
+		end = strtoll(word, &ptr, 10);
 	}
 
-	if (*wordi == wordc)
-		return 0;
-	if (target->keyword) {
-		int matched = 0;
-		struct token *_token;
-		struct cmd_node *_target;
-
-		do {
-			char *key;
-			_target = find_best_node(target->keyword, words[*wordi], &_token, NULL);
-			if (_target == NULL)
-				break;
+	if (errno || *ptr || start > end)
+		return -1;
+	if (start < token->min || end > token->max)
+		return -1;
 
-			matched++;
+	val->v.range.start = start;
+	val->v.range.end = end;
 
-			if (h) {
-				key = words[*wordi];
-				hashtable_set(h, key, "1");
-			}
+	return 0;
+}
+
+static int parse_ipv4(const char *word, struct ctoken *token, struct cmd_value *val)
+{
+	return inet_pton(AF_INET, word, &val->v.ipv4) == 1 ? 0 : -1;
+}
 
-			++(*wordi);
+/* xx:xx:xx:xx:xx:xx, '-' is accepted as separator as well */
+static int parse_mac(const char *word, struct ctoken *token, struct cmd_value *val)
+{
+	int i, n;
 
-			if (_target->children) {
-				if (*wordi == wordc) {
-					*ret = _target;
-					return 0;
-				}
-				_target = find_best_node(_target->children, words[*wordi], &_token, NULL);
-				if (_target == NULL)
-					return CMD_ERR_NO_MATCH;
-				if (h) {
-					hashtable_set(h, key, words[*wordi]);
-				}
-				++(*wordi);
-			}
-		} while (*wordi < wordc);
+	for (i = 0; i < 6; i++) {
+		for (n = 0, val->v.mac[i] = 0; n < 2 && isxdigit(*word); n++, word++) {
+			int c = tolower(*word);
 
-		if (*wordi == wordc) {
-			*ret = target;
-			return 0;
+			val->v.mac[i] <<= 4;
+			val->v.mac[i] |= isdigit(c) ? c - '0' : c - 'a' + 10;
 		}
+
+		if (n == 0)
+			return -1;
+		if (i < 5 && *word != ':' && *word != '-')
+			return -1;
+		if (i < 5)
+			word++;
 	}
 
-	if (target->children)
-		return cmd_search(target->children, ret, wordc, words, wordi, argc, argv, argi, h);
-	else
-		return CMD_ERR_NO_MATCH;
+	return *word ? -1 : 0;
 }
 
-static int line_get_args(const char *line, char ***argv)
+static int parse_ifname(const char *word, struct ctoken *token, struct cmd_value *val)
 {
-	size_t len = 0;
-	int count = 0;
-	const char *start, *next = line;
+	size_t len = strlen(word);
 
-	for (;;) {
-		start = next_key(&next);
-		if (start == NULL)
+	if (len == 0 || len >= IFNAMSIZ || strchr(word, '/'))
+		return -1;
+	if (!strcmp(word, ".") || !strcmp(word, ".."))
+		return -1;
+
+	val->v.str = word;
+
+	return 0;
+}
+
+struct var_type {
+	const char *name;
+	int type;
+	int size;
+	long long min, max;
+	int (*parse)(const char *word, struct ctoken *token, struct cmd_value *val);
+};
+
+static const struct var_type var_types[] = {
+	{ "INT",    CMD_VALUE_INT,    sizeof(int),          INT_MIN, INT_MAX,    parse_int    },
+	{ "UINT",   CMD_VALUE_UINT,   sizeof(unsigned int), 0,       UINT_MAX,   parse_uint   },
+	{ "HEX",    CMD_VALUE_UINT,   sizeof(uint32_t),     0,       UINT32_MAX, parse_hex    },
+	{ "HEX8",   CMD_VALUE_UINT,   sizeof(uint8_t),      0,       UINT8_MAX,  parse_hex    },
+	{ "HEX16",  CMD_VALUE_UINT,   sizeof(uint16_t),     0,       UINT16_MAX, parse_hex    },
+	{ "HEX32",  CMD_VALUE_UINT,   sizeof(uint32_t),     0,       UINT32_MAX, parse_hex    },
+	{ "RANGE",  CMD_VALUE_RANGE,  sizeof(struct cmd_range), INT_MIN, INT_MAX, parse_range },
+	{ "IPV4",   CMD_VALUE_IPV4,   sizeof(uint32_t),     0,       0,          parse_ipv4   },
+	{ "MAC",    CMD_VALUE_MAC,    6,                    0,       0,          parse_mac    },
+	{ "IFNAME", CMD_VALUE_STRING, sizeof(char *),       0,       0,          parse_ifname },
+};
+
+/*
+ * Look up the validator of a variable such as INT or INT<0-31>. Unknown
+ * names stay untyped placeholders matching any word.
+ */
+static int compile_vtype(struct ctoken *ct, const char *key)
+{
+	const char *bound = strchr(key, '<');
+	size_t len = bound ? bound - key : strlen(key);
+	const struct var_type *vt;
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(var_types); i++) {
+		vt = &var_types[i];
+		if (strlen(vt->name) == len && !strncmp(vt->name, key, len))
 			break;
-		count++;
 	}
 
-	if (count == 0)
+	if (i == ARRAY_SIZE(var_types))
 		return 0;
 
-	next = line;
-	*argv = malloc(sizeof(char *) * (count + 1));
-	if (*argv == NULL)
-		return -ENOMEM;
-	(*argv)[count] = NULL;
-	count = 0;
-
-	for (;;) {
-		char *arg;
+	ct->vtype = i + 1;
+	ct->min = vt->min;
+	ct->max = vt->max;
 
-		start = next_key(&next);
-		if (start == NULL)
-			break;
+	if (bound) {
+		long long min, max;
+		char *end;
 
-		len = next - start;
-		arg = malloc(len + 1);
-		if (arg == NULL) {
-			int i;
-			for (i = 0; i < count; i++)
-				free((*argv)[i]);
-			free(*argv);
-			return -ENOMEM;
-		}
+		if (vt->min == vt->max)
+			return -EINVAL;
 
-		memcpy(arg, start, len);
-		arg[len] = '\0';
+		errno = 0;
+		min = strtoll(bound + 1, &end, 0);
+		if (errno || end == bound + 1 || *end != '-')
+			return -EINVAL;
+		bound = end + 1;
+		max = strtoll(bound, &end, 0);
+		if (errno || end == bound || strcmp(end, ">"))
+			return -EINVAL;
+		if (min > max || min < vt->min || max > vt->max)
+			return -EINVAL;
 
-		(*argv)[count++] = arg;
+		ct->min = min;
+		ct->max = max;
 	}
 
-	return count;
-}
-
-static void line_free_args(int wordc, char **wordv)
-{
-	int i;
-	for (i = 0; i < wordc; i++)
-		free(wordv[i]);
-	if (wordc)
-		free(wordv);
+	return 0;
 }
 
-int cmd_pipe(struct term *term, char *cmd)
+static int match_word(struct ctoken *token, const char *word, struct cmd_value *val)
 {
-	int pfd[2][2];
-	pid_t pid;
+	if (token->vtype) {
+		const struct var_type *vt = &var_types[token->vtype - 1];
 
-	if (pipe(pfd[0]) < 0) {
-		term_print(term, "error pipe %s\r\n", strerror(errno));
-		return CMD_ERR_SYSTEM;
-	}
+		if (vt->parse(word, token, val) < 0)
+			return no_match;
 
-	if (pipe(pfd[1]) < 0) {
-		term_print(term, "error pipe %s\r\n", strerror(errno));
-		return CMD_ERR_SYSTEM;
+		val->type = vt->type;
+		val->size = vt->size;
+		return typed_match;
 	}
 
-	pid = fork();
-	if (pid < 0) {
-		term_print(term, "fork %s\r\n", strerror(errno));
-		return CMD_ERR_SYSTEM;
-	} else if (pid == 0) {
-		char *args[4] = {
-			"/bin/sh",
-			"-c",
-			cmd,
-			NULL
-		};
-
-		dup2(pfd[0][0], 0);
-		dup2(pfd[1][1], 1);
-		dup2(pfd[1][1], 2);
-
-		close(pfd[0][1]);
-		close(pfd[1][0]);
-
-		if (execv(args[0], args) < 0) {
-			printf("execvp %s\n", strerror(errno));
-			exit(CMD_ERR_SYSTEM);
-		}
-	} else {
-		char buf[128];
-		ssize_t r, c = 0;
-
-		close(pfd[0][0]);
-		close(pfd[1][1]);
-		stream_flush(term_ostream(term), pfd[0][1]);
-		close(pfd[0][1]);
+	val->type = CMD_VALUE_STRING;
+	val->v.str = word;
 
-		for (;;) {
-			r = read(pfd[1][0], buf, sizeof(buf));
-			if (r < 0) {
-				if (errno == EINTR)
-					continue;
-				term_print(term, "error execvp %s\r\n", strerror(errno));
-				return CMD_ERR_SYSTEM;
-			} else if (r == 0) {
-				waitpid(pid, NULL, 0);
-				break;
-			} else {
-				stream_put(term_ostream(term), buf, r);
-				c += r;
-			}
-		}
-	}
+	if (token->type == TOKEN_VARIABLE || token->type == TOKEN_OPTION)
+		return extend_match;
+	else if (token->type == TOKEN_VARARG)
+		return vararg_match;
 
-	return 0;
+	return no_match;
 }
 
-static void strip_head_blank(char **str)
+static struct centry *span_lookup(struct cmd_tree *tree, struct cspan *span,
+				  const char *word, uint32_t hash)
 {
-	char *ptr = *str;
+	struct centry *e;
+	struct ctoken *token;
+	uint32_t i;
 
-	while (*ptr && *ptr == ' ')
-		ptr++;
+	if (span->size == 0)
+		return NULL;
+
+	for (i = hash & (span->size - 1); ; i = (i + 1) & (span->size - 1)) {
+		e = &tree->index[span->index + i];
+		if (e->node == 0)
+			return NULL;
 
-	*str = ptr;
+		token = &tree->tokens[e->token];
+		if (token->hash == hash &&
+		    strcmp(tree_str(tree, token->key), word) == 0)
+			return e;
+	}
 }
 
-static void strip_tail_blank(const char *str, char **end)
+/* the radix node covering the keys of node starting with word */
+static struct cradix *radix_find(struct cmd_tree *tree, struct cnode *node,
+				 const char *word, size_t len)
 {
-	char *ptr = *end;
+	struct cradix *r, *c, *end;
+	const char *key;
+	size_t i = 0;
 
-	while (ptr > str && *(ptr - 1) == ' ')
-		ptr--;
+	if (node->nr_comp == 0)
+		return NULL;
 
-	*end = ptr;
+	for (r = &tree->radix[node->radix]; ; r = c) {
+		key = tree_str(tree, tree->comp[r->lo]);
+		if (strncmp(key + i, word + i, (len < r->depth ? len : r->depth) - i))
+			return NULL;
+		if (len <= r->depth)
+			return r;
+
+		i = r->depth;
+		c = &tree->radix[r->child];
+		end = c + r->nr_child;
+		for (; c < end; c++) {
+			if (tree_str(tree, tree->comp[c->lo])[i] == word[i])
+				break;
+		}
+		if (c == end)
+			return NULL;
+	}
 }
 
-int cmdopt_parse(struct term *term, struct cmdopt *opt, struct cmdoptattr *optattr)
+/* spans are embedded in the node owning them */
+static struct cnode *span_owner(struct cmd_tree *tree, struct cspan *span,
+				int *kind)
 {
-	int kpcount = hashtable_count(opt->kpairs);
-	int i;
-	struct optattr *attr;
+	struct cnode *node;
 
-	if (!optattr)
-		return 0;
+	node = &tree->nodes[((char *)span - (char *)tree->nodes) / sizeof(*node)];
+	*kind = span == &node->keyword;
 
-	if (optattr->init)
-		optattr->init(optattr->buf, optattr->bufsize);
-	else
-		memset(optattr->buf, 0, optattr->bufsize);
+	return node;
+}
 
-	if (!kpcount && !opt->argc)
-		return 0;
+/*
+ * The matcher advances every path of the tree fitting the words so far
+ * at once, with one thread per state and word. The threads of a word are
+ * kept in the order a greedy choice would try them: keywords before
+ * children, and a literal before the wild tokens in their best match
+ * order. A state reached twice keeps its first thread only, so a line is
+ * matched in a single pass. The live bitset of node indices tells which
+ * states the current word holds already, so a word has at most two
+ * threads per node. Both are scratch of one cmd_search() call, on the
+ * stack unless the tree is too large for it.
+ */
+#define NFA_STACK_THREADS	256
+#define NFA_STACK_LIVE		64	/* bitset words, 2048 nodes */
+
+enum {
+	NFA_START,	/* base is the owner of the head span */
+	NFA_CHILD,	/* node is a child of the previous base */
+	NFA_KEYWORD,	/* node is a keyword, base too if it takes a value */
+	NFA_VALUE,	/* node is the value of a keyword of base */
+	NFA_VARARG,	/* a word taken by the vararg node */
+};
 
-	for (i = 0; i < optattr->size; i++) {
-		attr = &optattr->attrs[i];
-		if (attr->index >= 0 && attr->index < opt->argc) {
-			int r;
-			r = attr->set(opt->argv[attr->index], optattr->buf + attr->offset);
-			if (r < 0) {
-				term_print(term, "invalid option %s.\r\n", opt->argv[attr->index]);
-				return -1;
-			}
-		} else if (attr->key) {
-			int r;
-			void *value;
+struct nfa_thread {
+	uint32_t node;
+	uint32_t token;
+	uint32_t base;		/* node whose spans take the next word */
+	int32_t prev;		/* thread of the previous word */
+	uint8_t kind;
+	uint8_t mode;		/* what the next word is matched against */
+};
 
-			value = hashtable_get(opt->kpairs, attr->key);
-			if (!value)
-				continue;
+struct nfa {
+	struct cmd_tree *tree;
+	struct nfa_thread *t;
+	int first;		/* first thread of the current word */
+	int nr, alloc;
+	uint64_t *live;
+	int error;		/* threads could not be added */
+	const char *word;
+	size_t len;
+	uint32_t hash;
+	int ambiguous;		/* an abbreviation of the word matched twice */
 
-			r = attr->set(value, optattr->buf + attr->offset);
-			if (r < 0) {
-				term_print(term, "invalid keyword %s:%s.\r\n", attr->key, value);
-				return -1;
-			}
-		} else {
-			term_print(term, "invalid attribute at %d\n", i);
-		}
+	struct nfa_thread t_buf[NFA_STACK_THREADS];
+	uint64_t live_buf[NFA_STACK_LIVE];
+};
+
+static int nfa_init(struct nfa *m, struct cmd_tree *tree)
+{
+	uint32_t n = (tree->nr_nodes * 2 + 63) / 64;
+
+	m->tree = tree;
+	m->t = m->t_buf;
+	m->alloc = NFA_STACK_THREADS;
+	m->first = 0;
+	m->nr = 1;
+	m->error = 0;
+
+	if (n <= NFA_STACK_LIVE) {
+		m->live = m->live_buf;
+		memset(m->live, 0, n * sizeof(*m->live));
+	} else {
+		m->live = calloc(n, sizeof(*m->live));
+		if (m->live == NULL)
+			return -ENOMEM;
 	}
 
 	return 0;
 }
 
-int cmd_execute(struct term *term, struct cmd_node *tree, const char *line)
+static void nfa_release(struct nfa *m)
 {
-	int i, wordc;
-	char **words;
+	if (m->t != m->t_buf)
+		free(m->t);
+	if (m->live != m->live_buf)
+		free(m->live);
+}
+
+static int nfa_grow(struct nfa *m)
+{
+	struct nfa_thread *t;
+	int alloc = m->alloc * 2;
+
+	if (m->t == m->t_buf) {
+		t = malloc(alloc * sizeof(*t));
+		if (t)
+			memcpy(t, m->t_buf, m->nr * sizeof(*t));
+	} else {
+		t = realloc(m->t, alloc * sizeof(*t));
+	}
+	if (t == NULL)
+		return -ENOMEM;
+
+	m->t = t;
+	m->alloc = alloc;
+
+	return 0;
+}
+
+static uint32_t nfa_state(struct nfa_thread *t)
+{
+	return t->base * 2 + (t->mode != NFA_CHILD);
+}
+
+static void nfa_add(struct nfa *m, struct centry *e, int prev, int kind,
+		    uint32_t base)
+{
+	struct cmd_tree *tree = m->tree;
+	struct nfa_thread *t;
+	uint32_t state;
+
+	if (m->nr == m->alloc && nfa_grow(m) < 0) {
+		m->error = -ENOMEM;
+		return;
+	}
+
+	t = &m->t[m->nr];
+	t->node = e->node;
+	t->token = e->token;
+	t->prev = prev;
+	t->kind = kind;
+	t->mode = NFA_CHILD;
+	t->base = base;
+	if (kind == NFA_VARARG ||
+	    (kind == NFA_CHILD && tree->tokens[e->token].type == TOKEN_VARARG)) {
+		t->mode = NFA_VARARG;
+		t->base = e->node;
+	} else if (kind == NFA_CHILD) {
+		t->base = e->node;
+	} else if (kind == NFA_KEYWORD && tree->nodes[e->node].children.count) {
+		t->mode = NFA_VALUE;
+		t->base = e->node;
+	}
+
+	state = nfa_state(t);
+	if (m->live[state / 64] & (1ULL << (state % 64)))
+		return;
+
+	m->live[state / 64] |= 1ULL << (state % 64);
+	m->nr++;
+}
+
+/*
+ * An exact literal is looked up in the hash index of the span, then a
+ * word which is the prefix of exactly one literal of the span stands for
+ * it. Other tokens are tried in the order of the wild list which keeps
+ * the best match type first, and all of them accepting the word are
+ * followed. An ambiguous prefix is not followed but noted.
+ */
+static void nfa_span(struct nfa *m, struct cspan *span, int prev, int kind,
+		     uint32_t base)
+{
+	struct cmd_tree *tree = m->tree;
+	struct cmd_value val;
+	struct centry *e;
+	struct cradix *r;
+	struct cnode *owner;
+	uint32_t i;
+	int which;
+
+	e = span_lookup(tree, span, m->word, m->hash);
+	if (e == NULL && span->size) {
+		owner = span_owner(tree, span, &which);
+		r = radix_find(tree, owner, m->word, m->len);
+		if (r && r->nr_lit[which] == 1)
+			e = &r->lit[which];
+		else if (r && r->nr_lit[which] > 1)
+			m->ambiguous = 1;
+	}
+
+	if (e)
+		nfa_add(m, e, prev, kind, base);
+
+	for (i = 0; i < span->nr_wild; i++) {
+		e = &tree->index[span->wild + i];
+		if (match_word(&tree->tokens[e->token], m->word, &val) != no_match)
+			nfa_add(m, e, prev, kind, base);
+	}
+}
+
+static void nfa_step(struct nfa *m, int i)
+{
+	struct cmd_tree *tree = m->tree;
+	struct nfa_thread *t = &m->t[i];
+	struct cnode *base = &tree->nodes[t->base];
+	struct centry e;
+
+	switch (t->mode) {
+	case NFA_VARARG:
+		e.node = t->node;
+		e.token = t->token;
+		nfa_add(m, &e, i, NFA_VARARG, 0);
+		break;
+	case NFA_VALUE:
+		nfa_span(m, &base->children, i, NFA_VALUE, base->parent);
+		break;
+	default:
+		if (t->kind != NFA_START)
+			nfa_span(m, &base->keyword, i, NFA_KEYWORD, t->base);
+		nfa_span(m, &base->children, i, NFA_CHILD, 0);
+		break;
+	}
+}
+
+/* literals are passed in full even when abbreviated */
+static char *token_word(struct cmd_tree *tree, struct ctoken *token, char *word)
+{
+	if (token->type == TOKEN_LITERAL)
+		return (char *)tree_str(tree, token->key);
+
+	return word;
+}
+
+/* fill argv and the option slots along the path of thread i */
+static void nfa_replay(struct nfa *m, int i, int wordc, char **words,
+		       char **argv, int *argi, struct cmdopt *opt)
+{
+	struct cmd_tree *tree = m->tree;
+	struct nfa_thread *t;
+	struct ctoken *token;
+	struct cnode *node;
+	struct cmd_value val;
+	int path[MAXARGC];
+	uint32_t slot;
+	int w;
+
+	for (w = wordc; w > 0; w--, i = m->t[i].prev)
+		path[w - 1] = i;
+
+	for (w = 0; w < wordc; w++) {
+		t = &m->t[path[w]];
+		node = &tree->nodes[t->node];
+		token = &tree->tokens[t->token];
+
+		if (token->type == TOKEN_LITERAL) {
+			val.type = CMD_VALUE_STRING;
+			val.v.str = tree_str(tree, token->key);
+		} else {
+			match_word(token, words[w], &val);
+		}
+
+		switch (t->kind) {
+		case NFA_CHILD:
+		case NFA_VARARG:
+			if (node->nr_tokens == 1 && token->type == TOKEN_LITERAL)
+				break;
+			if (opt)
+				opt->argval[*argi] = val;
+			argv[(*argi)++] = token_word(tree, token, words[w]);
+			break;
+		case NFA_KEYWORD:
+			slot = node->slot;
+			if (opt && slot < CMD_MAXSLOTS) {
+				opt->keys[slot] = tree_str(tree, token->key);
+				opt->values[slot] = "1";
+				opt->slotval[slot].type = CMD_VALUE_FLAG;
+				opt->slotmask |= 1U << slot;
+			}
+			break;
+		case NFA_VALUE:
+			slot = tree->nodes[node->parent].slot;
+			if (opt && slot < CMD_MAXSLOTS) {
+				opt->values[slot] = token_word(tree, token, words[w]);
+				opt->slotval[slot] = val;
+			}
+			break;
+		}
+	}
+}
+
+/* a keyword takes a word before a literal, which takes it before a variable */
+static int nfa_rank(struct nfa *m, struct nfa_thread *t)
+{
+	if (t->kind == NFA_KEYWORD)
+		return 0;
+
+	return m->tree->tokens[t->token].type == TOKEN_LITERAL ? 1 : 2;
+}
+
+/* compare the paths to threads a and b from their first word */
+static int nfa_compare(struct nfa *m, int a, int b, int wordc)
+{
+	int pa[MAXARGC], pb[MAXARGC];
+	int w, d;
+
+	for (w = wordc; w > 0; w--) {
+		pa[w - 1] = a;
+		pb[w - 1] = b;
+		a = m->t[a].prev;
+		b = m->t[b].prev;
+	}
+
+	for (w = 0; w < wordc; w++) {
+		d = nfa_rank(m, &m->t[pa[w]]) - nfa_rank(m, &m->t[pb[w]]);
+		if (d)
+			return d;
+	}
+
+	return 0;
+}
+
+/*
+ * The first executable thread, which ranks best as the threads are kept
+ * in the order of their paths. When strict, -1 if a thread of another
+ * command ranks the same.
+ */
+static int nfa_pick(struct nfa *m, int wordc, int strict)
+{
+	struct cmd_tree *tree = m->tree;
+	int i, elem, best = -1;
+
+	for (i = m->first; i < m->nr; i++) {
+		elem = tree->nodes[m->t[i].base].elem;
+		if (elem < 0)
+			continue;
+
+		if (best < 0) {
+			best = i;
+			if (!strict)
+				break;
+		} else if (elem != tree->nodes[m->t[best].base].elem &&
+			   nfa_compare(m, best, i, wordc) == 0) {
+			return -1;
+		}
+	}
+
+	return best < 0 ? m->first : best;
+}
+
+/*
+ * On success ret_node is the node the words lead to, the first executable one
+ * if the words fit several commands. The words fail as ambiguous if the
+ * last of them to match anything was an ambiguous abbreviation, or, when
+ * they are to run (opt given), if they fit two commands of the same rank.
+ */
+static int cmd_search(struct cmd_tree *tree, struct cspan *head,
+		      struct cnode **ret_node, int wordc, char **words, int *wordi,
+		      char **argv, int *argi, struct cmdopt *opt)
+{
+	struct nfa m;
+	struct nfa_thread *t;
+	int i, w, end, which, ret = 0;
+
+	if (nfa_init(&m, tree) < 0)
+		return CMD_ERR_SYSTEM;
+
+	m.t[0].base = span_owner(tree, head, &which) - tree->nodes;
+	m.t[0].kind = NFA_START;
+	m.t[0].mode = NFA_CHILD;
+	m.t[0].prev = -1;
+
+	for (w = 0; w < wordc; w++) {
+		end = m.nr;
+		i = m.first;
+		m.first = end;
+		m.word = words[w];
+		m.len = strlen(m.word);
+		m.hash = string_hash_n(m.word, m.len);
+		m.ambiguous = 0;
+		for (; i < end; i++)
+			nfa_step(&m, i);
+
+		if (m.error) {
+			ret = CMD_ERR_SYSTEM;
+			goto out;
+		}
+
+		for (i = end; i < m.nr; i++) {
+			uint32_t state = nfa_state(&m.t[i]);
+
+			m.live[state / 64] &= ~(1ULL << (state % 64));
+		}
+
+		if (m.nr == end) {
+			ret = m.ambiguous ? CMD_ERR_AMBIGUOUS : CMD_ERR_NO_MATCH;
+			goto out;
+		}
+	}
+
+	i = nfa_pick(&m, wordc, opt != NULL);
+	if (i < 0) {
+		ret = CMD_ERR_AMBIGUOUS;
+		goto out;
+	}
+
+	t = &m.t[i];
+	*ret_node = &tree->nodes[t->base];
+	*wordi = wordc;
+	nfa_replay(&m, i, wordc, words, argv, argi, opt);
+
+out:
+	nfa_release(&m);
+	return ret;
+}
+
+/*
+ * Words of a command line are copied once into buf and terminated in
+ * place, so tokenizing a line never touches the heap.
+ */
+struct cmd_line {
+	char buf[CMD_LINE_MAX];
+	char *words[MAXARGC];
+};
+
+static int line_get_args(const char *line, struct cmd_line *cl)
+{
+	size_t len, used = 0;
+	int count = 0;
+	const char *start, *next = line;
+
+	for (;;) {
+		start = next_key(&next);
+		if (start == NULL)
+			break;
+
+		len = next - start;
+		if (count == MAXARGC || used + len + 1 > sizeof(cl->buf))
+			return -E2BIG;
+
+		memcpy(cl->buf + used, start, len);
+		cl->buf[used + len] = '\0';
+		cl->words[count++] = cl->buf + used;
+		used += len + 1;
+	}
+
+	return count;
+}
+
+/*
+ * Run the pipe on the command output, the leading built-in filters in
+ * place and the rest, if any, as a shell job in the background of the
+ * terminal.
+ */
+static int cmd_filter(struct term *term, char *spec)
+{
+	struct stream *out = term_ostream(term);
+	struct filter_chain *chain;
+	const char *rest;
+	char err[64];
+	int ret;
+
+	ret = filter_chain_parse(term_arena(term), spec, &chain, &rest,
+				 err, sizeof(err));
+	if (ret < 0 && ret != -ENOENT) {
+		stream_consume(out, stream_ndata(out));
+		term_print(term, "%% Invalid pipe - %s.\r\n",
+			   ret == -EINVAL ? err : strerror(-ret));
+		return CMD_ERR_SYSTEM;
+	}
+
+	if (ret == 0) {
+		ret = filter_chain_run(chain, out);
+		filter_chain_free(chain);
+		if (ret < 0) {
+			term_print(term, "%% Pipe failed - %s.\r\n", strerror(-ret));
+			return CMD_ERR_SYSTEM;
+		}
+	} else {
+		rest = spec;
+	}
+
+	if (rest == NULL)
+		return CMD_SUCCESS;
+
+	ret = term_pipe(term, rest + 1);
+	if (ret == 0)
+		return CMD_SUCCESS_DAEMON;
+
+	stream_consume(out, stream_ndata(out));
+	term_print(term, "%% Pipe failed - %s.\r\n", strerror(-ret));
+	return CMD_ERR_SYSTEM;
+}
+
+/* store a converted value with the natural C type of its placeholder */
+static void cmd_value_store(const struct cmd_value *val, void *dst)
+{
+	switch (val->type) {
+	case CMD_VALUE_FLAG:
+		*(bool *)dst = true;
+		break;
+	case CMD_VALUE_STRING:
+		*(const char **)dst = val->v.str;
+		break;
+	case CMD_VALUE_INT:
+	case CMD_VALUE_UINT:
+		if (val->size == sizeof(uint8_t))
+			*(uint8_t *)dst = val->v.u;
+		else if (val->size == sizeof(uint16_t))
+			*(uint16_t *)dst = val->v.u;
+		else if (val->size == sizeof(uint32_t))
+			*(uint32_t *)dst = val->v.u;
+		else
+			*(uint64_t *)dst = val->v.u;
+		break;
+	case CMD_VALUE_RANGE:
+		memcpy(dst, &val->v.range, sizeof(val->v.range));
+		break;
+	case CMD_VALUE_IPV4:
+		memcpy(dst, &val->v.ipv4, sizeof(val->v.ipv4));
+		break;
+	case CMD_VALUE_MAC:
+		memcpy(dst, val->v.mac, sizeof(val->v.mac));
+		break;
+	}
+}
+
+static int cmdopt_parse(struct term *term, struct cmdopt *opt,
+			struct cmdoptattr *optattr, const uint8_t *binds)
+{
+	int i;
+	struct optattr *attr;
+
+	if (!optattr)
+		return 0;
+
+	if (optattr->init)
+		optattr->init(optattr->buf, optattr->bufsize);
+	else
+		memset(optattr->buf, 0, optattr->bufsize);
+
+	if (!opt->slotmask && !opt->argc)
+		return 0;
+
+	for (i = 0; i < optattr->size; i++) {
+		attr = &optattr->attrs[i];
+		if (attr->index >= 0 && attr->index < opt->argc) {
+			int r;
+
+			if (!attr->set) {
+				cmd_value_store(&opt->argval[attr->index],
+						optattr->buf + attr->offset);
+				continue;
+			}
+
+			r = attr->set(opt->argv[attr->index], optattr->buf + attr->offset);
+			if (r < 0) {
+				term_print(term, "invalid option %s.\r\n", opt->argv[attr->index]);
+				return -1;
+			}
+		} else if (attr->key) {
+			int r;
+			const char *value;
+
+			if (binds[i] == CMD_NOSLOT ||
+			    !(opt->slotmask & (1U << binds[i])))
+				continue;
+			value = opt->values[binds[i]];
+
+			if (!attr->set) {
+				cmd_value_store(&opt->slotval[binds[i]],
+						optattr->buf + attr->offset);
+				continue;
+			}
+
+			r = attr->set(value, optattr->buf + attr->offset);
+			if (r < 0) {
+				term_print(term, "invalid keyword %s:%s.\r\n", attr->key, value);
+				return -1;
+			}
+		} else {
+			term_print(term, "invalid attribute at %d\n", i);
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * The elem and its matched arguments and keywords, where abbreviated
+ * literals are already expanded. Returns 0 if it does not fit.
+ */
+static int cache_key(const struct cmd_elem *elem, struct cmdopt *opt,
+		     char *key, size_t size)
+{
+	size_t len = sizeof(elem);
+	int i, n;
+
+	memcpy(key, &elem, sizeof(elem));
+	for (i = 0; i < opt->argc; i++) {
+		n = snprintf(key + len, size - len, "%s%c", opt->argv[i], 0);
+		if (n >= size - len)
+			return 0;
+		len += n;
+	}
+
+	for (i = 0; i < CMD_MAXSLOTS; i++) {
+		if (!(opt->slotmask & (1U << i)))
+			continue;
+		n = snprintf(key + len, size - len, "%c%s%c", i + 1,
+			     opt->values[i], 0);
+		if (n >= size - len)
+			return 0;
+		len += n;
+	}
+
+	return len;
+}
+
+static uint64_t stat_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void stat_record(struct cmd_stat *st, int ret, uint64_t ns, size_t bytes)
+{
+	int b = ns ? 64 - __builtin_clzll(ns) : 0;
+
+	st->calls++;
+	st->bytes += bytes;
+	if (st->max_ns < ns)
+		st->max_ns = ns;
+	st->hist[b < STAT_BUCKETS ? b : STAT_BUCKETS - 1]++;
+	if (ret != CMD_SUCCESS && ret != CMD_SUCCESS_DAEMON)
+		st->errors[ret >= 0 && ret < STAT_CODES ? ret : STAT_CODES - 1]++;
+}
+
+/*
+ * Upper bound in ns of the bucket holding the given permille of calls,
+ * which may not exceed the slowest call.
+ */
+static uint64_t stat_percentile(const struct cmd_stat *st, int permille)
+{
+	uint64_t seen = 0, want = (st->calls * permille + 999) / 1000;
+	int b;
+
+	for (b = 0; b < STAT_BUCKETS; b++) {
+		seen += st->hist[b];
+		if (seen >= want)
+			break;
+	}
+
+	if (b == 0)
+		return 0;
+
+	return (1ULL << b) < st->max_ns ? 1ULL << b : st->max_ns;
+}
+
+void cmd_stats_show(struct cmd_tree *tree, struct stream *out)
+{
+	const struct cmd_stat *st;
+	uint64_t errors;
+	size_t i;
+	int c;
+
+	stream_puts(out, "%10s %8s %10s %9s %9s %9s  %s\r\n", "calls", "errors",
+		    "bytes", "p50(us)", "p99(us)", "max(us)", "command");
+
+	for (i = 0; i < tree->nr_elems; i++) {
+		st = &tree->stats[i];
+		if (st->calls == 0)
+			continue;
+
+		for (errors = 0, c = 0; c < STAT_CODES; c++)
+			errors += st->errors[c];
+
+		stream_puts(out, "%10llu %8llu %10llu %9.1f %9.1f %9.1f  %s\r\n",
+			    (unsigned long long)st->calls,
+			    (unsigned long long)errors,
+			    (unsigned long long)st->bytes,
+			    stat_percentile(st, 500) / 1e3,
+			    stat_percentile(st, 990) / 1e3,
+			    st->max_ns / 1e3, tree->elems[i]->line);
+
+		if (errors == 0)
+			continue;
+
+		stream_puts(out, "%10s", "");
+		for (c = 0; c < STAT_CODES; c++) {
+			if (st->errors[c])
+				stream_puts(out, " %s%d:%llu", c == STAT_CODES - 1 ? ">=" : "",
+					    c, (unsigned long long)st->errors[c]);
+		}
+		stream_puts(out, "\r\n");
+	}
+}
+
+void cmd_stats_reset(struct cmd_tree *tree)
+{
+	memset(tree->stats, 0, tree->nr_elems * sizeof(struct cmd_stat));
+}
+
+int cmd_execute(struct term *term, struct cmd_tree *tree, const char *line)
+{
+	int i, wordc;
+	struct cmd_line cl;
+	char **words = cl.words;
 	int wordi = 0;
 	int ret;
-	struct cmd_node *node;
+	struct cnode *node;
 	struct cmdopt *opt = term_cmdopt(term);
 
-	wordc = line_get_args(line, &words);
-	if (wordc < 0)
-		return CMD_ERR_SYSTEM;
-	else if (wordc == 0)
+	wordc = line_get_args(line, &cl);
+	if (wordc < 0) {
+		term_print(term, "%% Command too long.\r\n");
+		return CMD_ERR_EXEED_ARGC_MAX;
+	} else if (wordc == 0)
 		return CMD_SUCCESS;
 
 	for (i = 0; i < wordc; i++) {
@@ -975,15 +1872,39 @@ int cmd_execute(struct term *term, struct cmd_node *tree, const char *line)
 		return CMD_ERR_NO_MATCH;
 	}
 
-	ret = cmd_search(tree->children, &node, i, words, &wordi, 1024, opt->argv, &opt->argc, opt->kpairs);
+	tree_prepare(tree, words[0]);
+
+	ret = cmd_search(tree, &tree_root(tree)->children, &node, i, words,
+			 &wordi, opt->argv, &opt->argc, opt);
 	if (ret != 0) {
-		ret = CMD_ERR_NO_MATCH;
-	} else if (!node->func) {
+		;
+	} else if (node->elem < 0) {
 		ret = CMD_ERR_INCOMPLETE;
 	} else {
-		ret = cmdopt_parse(term, opt, node->optattr);
-		if (ret == 0)
-			ret = node->func(term, opt);
+		const struct cmd_elem *elem = tree->elems[node->elem];
+		size_t bytes = stream_ndata(term_ostream(term));
+		uint64_t start = stat_now();
+		char key[CMD_LINE_MAX];
+		int klen = 0;
+
+		if (elem->cache_ms)
+			klen = cache_key(elem, opt, key, sizeof(key));
+
+		if (klen > 0 && output_cache_get(key, klen, term_ostream(term))) {
+			ret = CMD_SUCCESS;
+		} else {
+			opt->pipe = i < wordc ? words[i] : NULL;
+			ret = cmdopt_parse(term, opt, elem->optattr,
+					   &tree->binds[node->bind]);
+			if (ret == 0)
+				ret = elem->func(term, opt);
+			if (ret == CMD_SUCCESS && klen > 0)
+				output_cache_put(key, klen, term_ostream(term), bytes,
+						 elem->cache_ms);
+		}
+
+		stat_record(&tree->stats[node->elem], ret, stat_now() - start,
+			    stream_ndata(term_ostream(term)) - bytes);
 	}
 
 	cmdopt_clear(opt);
@@ -993,6 +1914,9 @@ int cmd_execute(struct term *term, struct cmd_node *tree, const char *line)
 		case CMD_ERR_NO_MATCH:
 			term_print(term, "%% Unknown command - %s.\r\n", line);
 			break;
+		case CMD_ERR_AMBIGUOUS:
+			term_print(term, "%% Ambiguous command - %s.\r\n", line);
+			break;
 		case CMD_ERR_INCOMPLETE:
 			term_print(term, "%% Command incomplete.\r\n");
 			break;
@@ -1003,427 +1927,1873 @@ int cmd_execute(struct term *term, struct cmd_node *tree, const char *line)
 	}
 
 	if (i < wordc && ret == CMD_SUCCESS) {
-		char *ptr = &words[i][1];
-		char *key = NULL, *key_end = NULL;
-		char *next = NULL, *next_end = NULL;
-		int handled = 0;
-
-		strip_head_blank(&ptr);
-
-		if (*ptr) {
-			key = ptr;
-			while (*ptr && *ptr != ' ')
-				ptr++;
-			key_end = ptr;
-		}
+		term_more_drain(term);
+		ret = cmd_filter(term, words[i]);
+	}
+
+	return ret;
+}
+
+static size_t str_lcp(const char *s1, const char *s2)
+{
+	size_t i;
+
+	for (i = 0; s1[i] && s1[i] == s2[i]; i++)
+		;
+
+	return i;
+}
+
+/* a mapped image keeps offsets only, the pointers are resolved once */
+static const char **tree_comp_keys(struct cmd_tree *tree)
+{
+	uint32_t i;
+
+	if (tree->comp_keys || tree->nr_comp == 0)
+		return tree->comp_keys;
+
+	tree->comp_keys = malloc(tree->nr_comp * sizeof(char *));
+	if (tree->comp_keys == NULL)
+		return NULL;
+
+	for (i = 0; i < tree->nr_comp; i++)
+		tree->comp_keys[i] = tree_str(tree, tree->comp[i]);
+
+	return tree->comp_keys;
+}
+
+static int get_complete(struct cmd_tree *tree, struct cnode *base,
+			const char *word, int *n, const char *const **keys,
+			int *lcp)
+{
+	size_t len = word ? strlen(word) : 0;
+	struct cradix *r;
+
+	r = radix_find(tree, base, word ? word : "", len);
+	if (r == NULL)
+		return CMD_ERR_NO_MATCH;
+
+	*n = r->hi - r->lo;
+	if (tree_comp_keys(tree) == NULL)
+		return CMD_ERR_SYSTEM;
+
+	*keys = &tree->comp_keys[r->lo];
+	*lcp = r->depth;
+
+	if (*n == 1)
+		return CMD_COMPLETE_FULL_MATCH;
+
+	return *lcp > len ? CMD_COMPLETE_MATCH : CMD_COMPLETE_LIST_MATCH;
+}
+
+static int _cmd_complete(struct cmd_tree *tree, const char *line, int wordc,
+			 char **words, int *n, const char *const **keys, int *lcp)
+{
+	struct cnode *base = tree_root(tree);
+	char *argv[MAXARGC];
+	int argi = 0, wordi = 0;
+	int ret;
+	const char *word;
+	int _wordc = wordc;
+
+	if (wordc == 0)
+		return CMD_SUCCESS;
+
+	if (wordc && line[strlen(line)-1] != ' ') {
+		_wordc = wordc - 1;
+	}
+
+	if (_wordc > 0) {
+		tree_prepare(tree, words[0]);
+		ret = cmd_search(tree, &base->children, &base, _wordc, words,
+				 &wordi, argv, &argi, NULL);
+		if (ret != 0) {
+			return CMD_ERR_NO_MATCH;
+		}
+	}
+
+	word = wordi < wordc ? words[wordi] : NULL;
+
+	return get_complete(tree, base, word, n, keys, lcp);
+}
+
+/*
+ * On success keys points into the tree, which must stay referenced while
+ * they are used. lcp is the length of the prefix shared by all n keys.
+ */
+int cmd_complete(struct cmd_tree *tree, const char *line, int *n,
+		 const char *const **keys, int *lcp)
+{
+	int ret;
+	int i, wordc;
+	struct cmd_line cl;
+
+	wordc = line_get_args(line, &cl);
+	if (wordc < 0)
+		return CMD_ERR_EXEED_ARGC_MAX;
+
+	for (i = 0; i < wordc; i++) {
+		if (cl.words[i][0] == '|')
+			return CMD_SUCCESS;
+	}
+
+	ret = _cmd_complete(tree, line, wordc, cl.words, n, keys, lcp);
+	return ret;
+}
+
+static int alloc_desc(struct arena *arena, size_t count, char ***keys, char ***descs)
+{
+	*keys = arena_calloc(arena, count + 1, sizeof(char *));
+	if (*keys == NULL)
+		return -ENOMEM;
+	*descs = arena_calloc(arena, count + 1, sizeof(char *));
+	if (*descs == NULL)
+		return -ENOMEM;
+
+	return 0;
+}
+
+static int get_desc(struct cmd_tree *tree, struct arena *arena,
+		    struct cnode *base, const char *word, int *n,
+		    char ***keys, char ***descs)
+{
+	size_t count;
+	size_t len;
+	int index = 0;
+	struct cnode *node;
+	struct ctoken *token;
+	struct cspan *head = &base->children;
+	struct cspan *keyword = &base->keyword;
+
+	len = word ? strlen(word) : 0;
+
+	count  = token_count(tree, head, word, len);
+	count += token_count(tree, keyword, word, len);
+	if (count <= 0)
+		return CMD_ERR_NO_MATCH;
+
+	*n = count;
+	if (alloc_desc(arena, count, keys, descs) < 0)
+		return CMD_ERR_SYSTEM;
+
+	for_each_span_node(tree, head, node) {
+		for_each_cnode_token(tree, node, token) {
+			const char *key = tree_str(tree, token->key);
+
+			if (!len || strncmp(key, word, len) == 0) {
+				(*keys)[index] = (char *)key;
+				(*descs)[index] = (char *)tree_str(tree, token->desc);
+				index++;
+			}
+		}
+	}
+
+	for_each_span_node(tree, keyword, node) {
+		for_each_cnode_token(tree, node, token) {
+			const char *key = tree_str(tree, token->key);
+
+			if (!len || strncmp(key, word, len) == 0) {
+				(*keys)[index] = (char *)key;
+				(*descs)[index] = (char *)tree_str(tree, token->desc);
+				index++;
+			}
+		}
+	}
+
+	return count == 1 ? CMD_COMPLETE_FULL_MATCH : CMD_COMPLETE_LIST_MATCH;
+}
+
+static int _cmd_describe(struct cmd_tree *tree, struct arena *arena,
+			 const char *line, int wordc, char **words, int *n,
+			 char ***keys, char ***descs, int *cr)
+{
+	struct cnode *base = tree_root(tree);
+	char *argv[MAXARGC];
+	int argi = 0, wordi = 0;
+	int i, ret;
+	const char *word;
+	int _wordc = wordc;
+
+	if (wordc && line[strlen(line)-1] != ' ') {
+		_wordc = wordc - 1;
+	}
+
+	if (_wordc > 0) {
+		tree_prepare(tree, words[0]);
+		ret = cmd_search(tree, &base->children, &base, _wordc, words,
+				 &wordi, argv, &argi, NULL);
+		if (ret != 0) {
+			return CMD_ERR_NO_MATCH;
+		}
+	}
+
+	word = wordi < wordc ? words[wordi] : NULL;
+	*cr = _wordc == wordc && base->elem >= 0 ? 1 : 0;
+
+	ret = get_desc(tree, arena, base, word, n, keys, descs);
+
+	if (word) {
+		for (i = 0; i < *n; i++) {
+			if (strcmp(word, (*keys)[i]) == 0) {
+				if (base->elem >= 0)
+					*cr = 1;
+				break;
+			}
+		}
+	}
+
+	return ret;
+}
+
+int cmd_describe(struct cmd_tree *tree, struct arena *arena, const char *line,
+		 int *n, char ***keys, char ***descs, int *cr)
+{
+	int ret;
+	int i, wordc;
+	struct cmd_line cl;
+
+	wordc = line_get_args(line, &cl);
+	if (wordc < 0)
+		return CMD_ERR_NO_MATCH;
+
+	for (i = 0; i < wordc; i++) {
+		if (cl.words[i][0] == '|')
+			return CMD_SUCCESS;
+	}
+
+	ret = _cmd_describe(tree, arena, line, wordc, cl.words, n, keys, descs, cr);
+
+	return ret;
+}
+
+extern const struct cmd_elem __start_cmd_section, __stop_cmd_section;
+
+static int elem_compare(const void *a, const void *b)
+{
+	const struct cmd_elem **ea = (const struct cmd_elem **)a;
+	const struct cmd_elem **eb = (const struct cmd_elem **)b;
+
+	return strcmp((*ea)->line, (*eb)->line);
+}
+
+/* The command syntax represented by line is from Quagga and gets simplified. */
+
+#define COMMON_COMMAND(func, line, desc)				\
+	static int func(struct term *term, struct cmdopt *opt);		\
+									\
+	struct cmd_elem cmd_common_##func = {				\
+		line, desc, func					\
+	};								\
+									\
+	static int func(struct term *term, struct cmdopt *opt)
+
+COMMON_COMMAND(list_commands,
+	"list",
+	"List all defined commands\n")
+{
+	return cmd_list_elems(term);
+}
+
+COMMON_COMMAND(quit_terminal,
+	"quit",
+	"Exit current terminal\n")
+{
+	stream_putc(term_ostream(term), 4);
+	term_flush(term);
+	term_quit(term);
+
+	return 0;
+}
+
+COMMON_COMMAND(exit_terminal,
+	"exit",
+	"Exit current terminal\n")
+{
+	term_flush(term);
+	term_quit(term);
+
+	return 0;
+}
+
+static const struct cmd_elem *common_cmds[] = {
+	&cmd_common_list_commands,
+	&cmd_common_quit_terminal,
+	&cmd_common_exit_terminal,
+	NULL
+};
+
+#define LIST_CHUNK	16
+
+/* the tree is held while paging, it keeps the elems of the modules */
+struct list_state {
+	struct cmd_tree *tree;
+	size_t count, next;
+	const struct cmd_elem *array[];
+};
+
+static int list_more(struct term *term, void *data)
+{
+	struct list_state *ls = data;
+	size_t end = ls->next + LIST_CHUNK;
+
+	for (; ls->next < ls->count && ls->next < end; ls->next++)
+		term_print(term, "  %s\r\n", ls->array[ls->next]->line);
+
+	return ls->next < ls->count;
+}
+
+static void list_release(void *data)
+{
+	struct list_state *ls = data;
+
+	cmd_tree_put(ls->tree);
+	free(ls);
+}
+
+/* the elems of the tree of the terminal, registered ones included */
+int cmd_list_elems(struct term *term)
+{
+	struct cmd_tree *tree = term_cmd_tree(term);
+	struct list_state *ls;
+	size_t nr_comm = ARRAY_SIZE(common_cmds) - 1;
+	size_t count = tree->nr_elems;
+
+	ls = malloc(sizeof(*ls) + count * sizeof(struct cmd_elem *));
+	if (ls == NULL)
+		return CMD_ERR_SYSTEM;
+
+	memcpy(ls->array, tree->elems, count * sizeof(struct cmd_elem *));
+	qsort(ls->array + nr_comm, count - nr_comm, sizeof(void *), elem_compare);
+
+	ls->tree = cmd_tree_get(tree);
+	ls->count = count;
+	ls->next = 0;
+
+	return term_more(term, list_more, ls, list_release) ? CMD_ERR_SYSTEM : CMD_SUCCESS;
+}
+
+static void count_nodes(struct cmd_node *node, uint32_t *nodes, uint32_t *tokens)
+{
+	for_each_node(node, node) {
+		(*nodes)++;
+		(*tokens) += node->nr_tokens;
+		if (node->children)
+			count_nodes(node->children, nodes, tokens);
+		if (node->keyword)
+			count_nodes(node->keyword, nodes, tokens);
+	}
+}
+
+static uint32_t compile_node(struct compiler *c, struct cmd_node *pnode,
+			     uint32_t parent)
+{
+	struct cmd_tree *tree = c->tree;
+	uint32_t idx = tree->nr_nodes++;
+	struct cnode *cnode = &tree->nodes[idx];
+	struct token *token;
+	int i;
+
+	memset(cnode, 0, sizeof(*cnode));
+	cnode->parent = parent;
+	cnode->elem = pnode->elem;
+	cnode->token = tree->nr_tokens;
+	cnode->nr_tokens = pnode->nr_tokens;
+	cnode->group = pnode->group;
+	if (pnode->group)
+		tree->groups[pnode->group - 1].node = idx;
+
+	for_each_token(pnode, i, token) {
+		struct ctoken *ct = &tree->tokens[tree->nr_tokens++];
+
+		ct->key = token->key;
+		ct->desc = token->desc;
+		ct->hash = string_hash(tree_str(tree, token->key));
+		ct->type = token->type;
+		ct->vtype = token->vtype;
+		ct->min = token->min;
+		ct->max = token->max;
+	}
+
+	return idx;
+}
+
+static int compile_index(struct compiler *c, struct cspan *span)
+{
+	struct cmd_tree *tree = c->tree;
+	uint32_t literals = 0, wild = 0, size = 0, total, i;
+	struct cnode *node;
+	struct ctoken *token;
+	struct centry *e;
+	int pass;
+
+	for_each_span_node(tree, span, node) {
+		for_each_cnode_token(tree, node, token) {
+			if (token->type == TOKEN_LITERAL)
+				literals++;
+			else
+				wild++;
+		}
+	}
+
+	if (literals)
+		for (size = 2; size < literals * 2; size <<= 1)
+			;
+
+	total = size + wild;
+	if (tree->nr_index + total > c->nr_index_alloc) {
+		uint32_t alloc = c->nr_index_alloc ? c->nr_index_alloc : 64;
+
+		while (alloc < tree->nr_index + total)
+			alloc *= 2;
+		e = realloc(tree->index, alloc * sizeof(struct centry));
+		if (e == NULL)
+			return -ENOMEM;
+		tree->index = e;
+		c->nr_index_alloc = alloc;
+	}
+
+	span->index = tree->nr_index;
+	span->size = size;
+	span->wild = span->index + size;
+	span->nr_wild = 0;
+	memset(&tree->index[span->index], 0, total * sizeof(struct centry));
+	tree->nr_index += total;
+
+	for_each_span_node(tree, span, node) {
+		for_each_cnode_token(tree, node, token) {
+			if (token->type != TOKEN_LITERAL)
+				continue;
+
+			for (i = token->hash & (size - 1); ; i = (i + 1) & (size - 1)) {
+				e = &tree->index[span->index + i];
+				if (e->node == 0) {
+					e->node = node - tree->nodes;
+					e->token = token - tree->tokens;
+					break;
+				}
+				/* the first sibling wins as in the linear search */
+				if (tree->tokens[e->token].key == token->key)
+					break;
+			}
+		}
+	}
+
+	/* typed variables, varargs, then the placeholders taking any word */
+	for (pass = 0; pass < 3; pass++) {
+		for_each_span_node(tree, span, node) {
+			for_each_cnode_token(tree, node, token) {
+				int order;
+
+				if (token->type == TOKEN_LITERAL)
+					continue;
+
+				if (token->vtype)
+					order = 0;
+				else if (token->type == TOKEN_VARARG)
+					order = 1;
+				else
+					order = 2;
+				if (order != pass)
+					continue;
+
+				e = &tree->index[span->wild + span->nr_wild++];
+				e->node = node - tree->nodes;
+				e->token = token - tree->tokens;
+			}
+		}
+	}
+
+	return 0;
+}
+
+static uint32_t keyword_slot(struct cmd_tree *tree, struct cnode *node,
+			     const char *key)
+{
+	struct cnode *kw;
+	struct ctoken *token;
+
+	for (;;) {
+		for_each_span_node(tree, &node->keyword, kw) {
+			token = &tree->tokens[kw->token];
+			if (!strcmp(tree_str(tree, token->key), key))
+				return kw->slot < CMD_MAXSLOTS ? kw->slot : CMD_NOSLOT;
+		}
+
+		if (node == tree_root(tree))
+			return CMD_NOSLOT;
+		node = &tree->nodes[node->parent];
+	}
+}
+
+/* resolve the keyword attrs of the command to slots on its path */
+static int compile_binds(struct compiler *c, struct cnode *node)
+{
+	struct cmd_tree *tree = c->tree;
+	struct cmdoptattr *optattr;
+	uint8_t *binds;
+	int i;
+
+	if (node->elem < 0 || !tree->elems[node->elem]->optattr)
+		return 0;
+
+	optattr = tree->elems[node->elem]->optattr;
+	binds = realloc(tree->binds, tree->nr_binds + optattr->size);
+	if (binds == NULL)
+		return -ENOMEM;
+	tree->binds = binds;
+
+	node->bind = tree->nr_binds;
+	tree->nr_binds += optattr->size;
+
+	for (i = 0; i < optattr->size; i++) {
+		struct optattr *attr = &optattr->attrs[i];
+
+		binds[node->bind + i] = CMD_NOSLOT;
+		if (attr->key)
+			binds[node->bind + i] = keyword_slot(tree, node, attr->key);
+	}
+
+	return 0;
+}
+
+static int comp_compare(const void *a, const void *b)
+{
+	return strcmp(*(const char **)a, *(const char **)b);
+}
+
+static void radix_add_key(struct cmd_tree *tree, struct cnode *cnode,
+			  struct cradix *r, const char *key)
+{
+	struct cspan *spans[] = { &cnode->children, &cnode->keyword };
+	struct centry *e;
+	int k;
+
+	for (k = 0; k < 2; k++) {
+		e = span_lookup(tree, spans[k], key, string_hash(key));
+		if (e) {
+			r->nr_lit[k]++;
+			r->lit[k] = *e;
+		}
+	}
+}
+
+static void compile_radix(struct cmd_tree *tree, struct cnode *cnode,
+			  uint32_t idx, uint32_t lo, uint32_t hi)
+{
+	struct cradix *r = &tree->radix[idx], *c;
+	const char **comp = tree->comp_keys;
+	uint32_t i, start = lo, child;
+	int k;
+
+	r->lo = lo;
+	r->hi = hi;
+	r->depth = hi - lo > 1 ? str_lcp(comp[lo], comp[hi - 1]) : strlen(comp[lo]);
+
+	/* a key ending here sorts first */
+	if (comp[lo][r->depth] == '\0') {
+		radix_add_key(tree, cnode, r, comp[lo]);
+		start++;
+	}
+
+	for (i = start; i < hi; i++) {
+		if (i == start || comp[i][r->depth] != comp[i - 1][r->depth])
+			r->nr_child++;
+	}
+
+	r->child = tree->nr_radix;
+	tree->nr_radix += r->nr_child;
+
+	for (child = r->child; start < hi; start = i, child++) {
+		for (i = start + 1; i < hi; i++) {
+			if (comp[i][r->depth] != comp[start][r->depth])
+				break;
+		}
+
+		compile_radix(tree, cnode, child, start, i);
+
+		/* the array is not reallocated, r stays valid */
+		c = &tree->radix[child];
+		for (k = 0; k < 2; k++) {
+			if (c->nr_lit[k])
+				r->lit[k] = c->lit[k];
+			r->nr_lit[k] += c->nr_lit[k];
+		}
+	}
+}
+
+/*
+ * Completion candidates of a node are the keys of both its spans, sorted
+ * and without duplicates, so a prefix selects a contiguous run of them.
+ * This runs after the strtab stops growing as the keys are borrowed.
+ */
+static void compile_comp(struct cmd_tree *tree, struct cnode *cnode)
+{
+	struct cspan *spans[] = { &cnode->children, &cnode->keyword };
+	const char **comp = &tree->comp_keys[tree->nr_comp];
+	struct cnode *node;
+	struct ctoken *token;
+	uint32_t i, n = 0, k;
+
+	for (k = 0; k < ARRAY_SIZE(spans); k++) {
+		for_each_span_node(tree, spans[k], node) {
+			for_each_cnode_token(tree, node, token)
+				comp[n++] = tree_str(tree, token->key);
+		}
+	}
+
+	qsort(comp, n, sizeof(char *), comp_compare);
+	for (i = 0, k = 0; i < n; i++) {
+		if (k == 0 || comp[k - 1] != comp[i])
+			comp[k++] = comp[i];
+	}
+	for (i = 0; i < k; i++)
+		tree->comp[tree->nr_comp + i] = comp[i] - tree->strtab;
+
+	cnode->comp = tree->nr_comp;
+	cnode->nr_comp = k;
+	tree->nr_comp += k;
+
+	if (k) {
+		cnode->radix = tree->nr_radix++;
+		compile_radix(tree, cnode, cnode->radix, cnode->comp,
+			      cnode->comp + k);
+	}
+}
+
+/* lay the children of pnode out as the spans of node idx */
+static int compile_spans(struct compiler *c, uint32_t idx, struct cmd_node *pnode,
+			 struct cmd_node **map, uint32_t base)
+{
+	struct cmd_tree *tree = c->tree;
+	struct cnode *cnode = &tree->nodes[idx], *node;
+	struct cmd_node *child;
+
+	cnode->children.node = tree->nr_nodes;
+	cnode->children.count = 0;
+	for_each_node(child, pnode->children) {
+		map[compile_node(c, child, idx) - base] = child;
+		cnode->children.count++;
+	}
+
+	cnode->keyword.node = tree->nr_nodes;
+	cnode->keyword.count = 0;
+	for_each_node(child, pnode->keyword) {
+		map[compile_node(c, child, idx) - base] = child;
+		cnode->keyword.count++;
+	}
+
+	if (compile_index(c, &cnode->children) < 0 ||
+	    compile_index(c, &cnode->keyword) < 0)
+		return -ENOMEM;
+
+	for_each_span_node(tree, &cnode->keyword, node)
+		node->slot = cnode->slot + (node - &tree->nodes[cnode->keyword.node]);
+	for_each_span_node(tree, &cnode->children, node)
+		node->slot = cnode->slot + cnode->keyword.count;
+
+	return 0;
+}
+
+/* words of a syntax line, an upper bound of the tokens it compiles to */
+static uint32_t line_tokens(const char *line)
+{
+	uint32_t n = 0;
+	bool sep, in = false;
+
+	for (; *line; line++) {
+		sep = isspace(*line) || strchr("{}()|", *line);
+		if (!sep && !in)
+			n++;
+		in = !sep;
+	}
+
+	return n;
+}
+
+/*
+ * The arrays and the strtab are sized for every elem of the tree,
+ * including the groups not parsed yet, and are never reallocated.
+ */
+static struct compiler *compiler_create(struct cmd_tree *tree)
+{
+	struct compiler *c;
+	uint32_t i, nr_nodes = 1, nr_tokens = 0, strtab = 1;
+
+	for (i = 0; i < tree->nr_elems; i++) {
+		const struct cmd_elem *elem = tree->elems[i];
+		uint32_t n = line_tokens(elem->line);
+
+		nr_tokens += n;
+		strtab += strlen(elem->line) + (elem->desc ? strlen(elem->desc) : 0) + 2 * n;
+	}
+	nr_nodes += nr_tokens;
+
+	c = calloc(1, sizeof(*c));
+	if (c == NULL)
+		return NULL;
+
+	c->tree = tree;
+	for (c->nr_strings = 16; c->nr_strings < nr_tokens * 4; c->nr_strings <<= 1)
+		;
+	c->strings = calloc(c->nr_strings, sizeof(uint32_t));
+	c->strtab_alloc = strtab;
+	/* spans index at most 4 entries per literal */
+	c->nr_index_alloc = nr_tokens * 4 + 1;
+	tree->index = malloc(c->nr_index_alloc * sizeof(struct centry));
+	tree->strtab = malloc(c->strtab_alloc);
+	tree->nodes = calloc(nr_nodes, sizeof(struct cnode));
+	tree->tokens = calloc(nr_tokens ? nr_tokens : 1, sizeof(struct ctoken));
+	tree->comp = calloc(nr_tokens ? nr_tokens : 1, sizeof(uint32_t));
+	tree->comp_keys = calloc(nr_tokens ? nr_tokens : 1, sizeof(char *));
+	/* a radix tree of n keys has at most 2n - 1 nodes */
+	tree->radix = calloc(nr_tokens * 2 + 1, sizeof(struct cradix));
+	if (!c->strings || !tree->index || !tree->strtab || !tree->nodes ||
+	    !tree->tokens || !tree->comp || !tree->comp_keys || !tree->radix) {
+		free(c->strings);
+		free(c);
+		return NULL;
+	}
+
+	tree->strtab[0] = '\0';
+	tree->strtab_len = 1;
+
+	return c;
+}
+
+/*
+ * Lay the parse tree out breadth first: the nodes array doubles as the
+ * queue, and appending all children of a node at once keeps them in one
+ * contiguous span.
+ */
+static int cmd_tree_compile(struct compiler *c, struct cmd_node *root)
+{
+	struct cmd_tree *tree = c->tree;
+	struct cmd_node **map;
+	uint32_t i, nr_nodes = 1, nr_tokens = 0;
+	int ret = -ENOMEM;
+
+	if (root->children)
+		count_nodes(root->children, &nr_nodes, &nr_tokens);
+
+	map = calloc(nr_nodes, sizeof(struct cmd_node *));
+	if (map == NULL)
+		return -ENOMEM;
+
+	map[compile_node(c, root, 0)] = root;
+
+	for (i = 0; i < tree->nr_nodes; i++) {
+		if (compile_spans(c, i, map[i], map, 0) < 0)
+			goto out;
+	}
+
+	for (i = 0; i < tree->nr_nodes; i++) {
+		if (compile_binds(c, &tree->nodes[i]) < 0)
+			goto out;
+	}
+
+	for (i = 0; i < tree->nr_nodes; i++)
+		compile_comp(tree, &tree->nodes[i]);
+
+	ret = 0;
+out:
+	free(map);
+
+	return ret;
+}
+
+/* parse the elems of the group of stub idx and compile them under it */
+static int tree_expand(struct cmd_tree *tree, uint32_t idx)
+{
+	struct cnode *stub = &tree->nodes[idx];
+	struct cgroup *grp = &tree->groups[stub->group - 1];
+	struct compiler *c = tree->compiler;
+	struct cmd_node *root, *pnode, **map = NULL;
+	uint32_t i, e, first = tree->nr_nodes, nr_nodes = 0, nr_tokens = 0;
+	uint64_t start = stat_now();
+	int ret = -ENOMEM;
+
+	root = cmd_node_new(NULL, 0);
+	if (root == NULL)
+		return -ENOMEM;
+
+	for (i = 0; i < grp->nr_elems; i++) {
+		e = tree->group_elems[grp->first + i];
+		if (cmd_add_elem(c, root, tree->elems[e], e) < 0)
+			printf("failed to add '%s'\r\n", tree->elems[e]->line);
+	}
+
+	/* every elem of the group starts with the literal of the stub */
+	pnode = root->children;
+	if (pnode && pnode->children)
+		count_nodes(pnode->children, &nr_nodes, &nr_tokens);
+	if (pnode && pnode->keyword)
+		count_nodes(pnode->keyword, &nr_nodes, &nr_tokens);
+
+	map = calloc(nr_nodes ? nr_nodes : 1, sizeof(struct cmd_node *));
+	if (map == NULL)
+		goto out;
+
+	if (pnode) {
+		stub->elem = pnode->elem;
+		if (compile_spans(c, idx, pnode, map, first) < 0)
+			goto out;
+		for (i = first; i < tree->nr_nodes; i++) {
+			if (compile_spans(c, i, map[i - first], map, first) < 0)
+				goto out;
+		}
+	}
+
+	if (compile_binds(c, stub) < 0)
+		goto out;
+	for (i = first; i < tree->nr_nodes; i++) {
+		if (compile_binds(c, &tree->nodes[i]) < 0)
+			goto out;
+	}
+
+	compile_comp(tree, stub);
+	for (i = first; i < tree->nr_nodes; i++)
+		compile_comp(tree, &tree->nodes[i]);
+
+	ret = 0;
+out:
+	/* never compiled twice, a failed group just lacks its commands */
+	stub->group = 0;
+	free(map);
+	cmd_node_delete(root);
+
+	tree->lazy_ns += stat_now() - start;
+	if (++tree->nr_parsed == tree->nr_groups) {
+		free(c->strings);
+		free(c);
+		tree->compiler = NULL;
+	}
+
+	return ret;
+}
+
+static void tree_expand_all(struct cmd_tree *tree)
+{
+	uint32_t i;
+
+	for (i = 0; i < tree->nr_groups; i++) {
+		if (tree->nodes[tree->groups[i].node].group)
+			tree_expand(tree, tree->groups[i].node);
+	}
+}
+
+/* parse the group a command line starting with word walks into */
+static void tree_prepare(struct cmd_tree *tree, const char *word)
+{
+	struct cnode *root = tree_root(tree);
+	struct centry *e;
+	struct cradix *r;
+
+	if (tree->nr_parsed == tree->nr_groups)
+		return;
+
+	e = span_lookup(tree, &root->children, word, string_hash(word));
+	if (e == NULL) {
+		r = radix_find(tree, root, word, strlen(word));
+		if (r && r->nr_lit[0] == 1)
+			e = &r->lit[0];
+	}
+
+	if (e && tree->nodes[e->node].group)
+		tree_expand(tree, e->node);
+}
+
+/* the first word of a line if the parser takes it as a literal, or 0 */
+static size_t first_literal(const char *line, const char **word)
+{
+	const char *p;
+
+	while (*line == ' ')
+		line++;
+
+	for (p = line; *p && !isspace(*p) && !strchr("{}()|", *p); p++)
+		;
+
+	if (p == line || (*p && strchr("{}()|", *p)) ||
+	    *line == '[' || *line == '.' || (*line >= 'A' && *line <= 'Z'))
+		return 0;
+
+	*word = line;
+
+	return p - line;
+}
+
+/* the node of the first literal of a group, as the parser would make it */
+static struct cmd_node *group_stub(struct compiler *c, const struct cmd_elem *elem,
+				   const char *word, size_t len, uint32_t group)
+{
+	struct cmd_node *node;
+	struct token *token;
+	const char *desc = elem->desc ? elem->desc : "", *help;
+
+	help = next_help(&desc);
+	if (help == NULL)
+		return NULL;
+
+	token = calloc(1, sizeof(*token));
+	if (token == NULL)
+		return NULL;
+
+	token->type = TOKEN_LITERAL;
+	token->key = compile_strn(c, word, len);
+	token->desc = compile_strn(c, help, desc - help);
+	node = cmd_node_new(token, 1);
+	if (!token->key || !node) {
+		free(token);
+		free(node);
+		return NULL;
+	}
+
+	node->group = group;
+
+	return node;
+}
+
+/*
+ * Elems starting with the same literal form a group, of which only the
+ * node of that literal is made now. Any other elem is parsed right away.
+ * Root children keep the order of the elems as when all are parsed.
+ */
+static int tree_group(struct compiler *c, struct cmd_node *root)
+{
+	struct cmd_tree *tree = c->tree;
+	struct cmd_node **tail = &root->children, *stub;
+	uint32_t *slots, *group_of, mask, h, i, g;
+	const struct cmd_elem *elem;
+	struct cgroup *grp;
+	const char *word;
+	size_t len, k;
+	int ret = -ENOMEM;
+
+	for (mask = 2; mask < tree->nr_elems * 2; mask <<= 1)
+		;
+	slots = calloc(mask--, sizeof(uint32_t));
+	group_of = calloc(tree->nr_elems + 1, sizeof(uint32_t));
+	tree->groups = calloc(tree->nr_elems + 1, sizeof(struct cgroup));
+	tree->group_elems = malloc((tree->nr_elems + 1) * sizeof(uint32_t));
+	if (!slots || !group_of || !tree->groups || !tree->group_elems)
+		goto out;
+
+	for (i = 0; i < tree->nr_elems; i++) {
+		elem = tree->elems[i];
+		len = first_literal(elem->line, &word);
+		if (len == 0) {
+			if (cmd_add_elem(c, root, elem, i) < 0)
+				printf("failed to add '%s'\r\n", elem->line);
+			while (*tail)
+				tail = &(*tail)->sibling;
+			continue;
+		}
+
+		for (h = string_hash_n(word, len) & mask; slots[h]; h = (h + 1) & mask) {
+			grp = &tree->groups[slots[h] - 1];
+			if (grp->len == len && !strncmp(grp->word, word, len))
+				break;
+		}
+
+		if (slots[h] == 0) {
+			g = tree->nr_groups;
+			stub = group_stub(c, elem, word, len, g + 1);
+			if (stub == NULL) {
+				if (cmd_add_elem(c, root, elem, i) < 0)
+					printf("failed to add '%s'\r\n", elem->line);
+				while (*tail)
+					tail = &(*tail)->sibling;
+				continue;
+			}
+
+			*tail = stub;
+			stub->parent = root;
+			tail = &stub->sibling;
+
+			tree->groups[g].word = word;
+			tree->groups[g].len = len;
+			slots[h] = ++tree->nr_groups;
+		}
+
+		group_of[i] = slots[h];
+		tree->groups[slots[h] - 1].nr_elems++;
+	}
+
+	for (g = 0, k = 0; g < tree->nr_groups; g++) {
+		tree->groups[g].first = k;
+		k += tree->groups[g].nr_elems;
+		tree->groups[g].nr_elems = 0;
+	}
+
+	for (i = 0; i < tree->nr_elems; i++) {
+		if (group_of[i] == 0)
+			continue;
+		grp = &tree->groups[group_of[i] - 1];
+		tree->group_elems[grp->first + grp->nr_elems++] = i;
+	}
+
+	ret = 0;
+out:
+	free(slots);
+	free(group_of);
+
+	return ret;
+}
+
+/*
+ * Elems registered at runtime, by cmd_register() or from the cmd_section
+ * of a plugin. The registry and every tree built from a module hold a
+ * reference, so a plugin is closed only after the last tree using its
+ * elems is gone.
+ */
+struct cmd_module {
+	int refcnt;
+	char *name;
+	void *handle;		/* of dlopen(), NULL if registered */
+	const struct cmd_elem *start, *end;
+	struct cmd_module *next;
+};
+
+static struct cmd_module *modules;
+
+static void module_put(struct cmd_module *mod)
+{
+	if (--mod->refcnt > 0)
+		return;
+
+	if (mod->handle)
+		dlclose(mod->handle);
+	free(mod->name);
+	free(mod);
+}
+
+static void cmd_tree_free(struct cmd_tree *tree)
+{
+	size_t i;
+
+	for (i = 0; i < tree->nr_mods; i++)
+		module_put(tree->mods[i]);
+	free(tree->mods);
+	free(tree->groups);
+	free(tree->group_elems);
+	if (tree->compiler) {
+		free(tree->compiler->strings);
+		free(tree->compiler);
+	}
+	free(tree->elems);
+	free(tree->stats);
+	free(tree->comp_keys);
+	if (tree->image) {
+		if (tree->image_size)
+			munmap(tree->image, tree->image_size);
+		free(tree);
+		return;
+	}
+	free(tree->nodes);
+	free(tree->tokens);
+	free(tree->index);
+	free(tree->binds);
+	free(tree->comp);
+	free(tree->radix);
+	free(tree->strtab);
+	free(tree);
+}
+
+/*
+ * A tree without arrays, with the elems of common_cmds, [start, end) and
+ * of the registered modules if with_mods.
+ */
+static struct cmd_tree *cmd_tree_alloc(const struct cmd_elem *start,
+				       const struct cmd_elem *end, bool with_mods)
+{
+	struct cmd_tree *tree;
+	struct cmd_module *mod;
+	const struct cmd_elem *elem;
+	size_t i, nr_comm = ARRAY_SIZE(common_cmds) - 1;
+
+	tree = calloc(1, sizeof(struct cmd_tree));
+	if (tree == NULL)
+		return NULL;
+	tree->refcnt = 1;
+
+	tree->nr_elems = nr_comm + (end - start);
+	for (mod = with_mods ? modules : NULL; mod; mod = mod->next) {
+		tree->nr_elems += mod->end - mod->start;
+		tree->nr_mods++;
+	}
+
+	tree->elems = malloc(tree->nr_elems * sizeof(struct cmd_elem *));
+	tree->stats = calloc(tree->nr_elems, sizeof(struct cmd_stat));
+	tree->mods = calloc(tree->nr_mods ? tree->nr_mods : 1, sizeof(struct cmd_module *));
+	if (tree->elems == NULL || tree->stats == NULL || tree->mods == NULL) {
+		tree->nr_mods = 0;
+		cmd_tree_free(tree);
+		return NULL;
+	}
+
+	for (i = 0; i < nr_comm; i++)
+		tree->elems[i] = common_cmds[i];
+	for (elem = start; elem < end; elem++)
+		tree->elems[i++] = elem;
+
+	tree->nr_mods = 0;
+	for (mod = with_mods ? modules : NULL; mod; mod = mod->next) {
+		for (elem = mod->start; elem < mod->end; elem++)
+			tree->elems[i++] = elem;
+		mod->refcnt++;
+		tree->mods[tree->nr_mods++] = mod;
+	}
+
+	return tree;
+}
+
+/* group the elems of an allocated tree, parse the others and compile */
+static struct cmd_tree *cmd_tree_populate(struct cmd_tree *tree)
+{
+	struct compiler *c;
+	struct cmd_node *root;
+	uint64_t start = stat_now();
+	int ret = -ENOMEM;
+
+	c = compiler_create(tree);
+	root = cmd_node_new(NULL, 0);
+	if (c && root)
+		ret = tree_group(c, root);
+	if (ret == 0)
+		ret = cmd_tree_compile(c, root);
+	if (root)
+		cmd_node_delete(root);
+
+	/* kept to parse the groups */
+	if (ret == 0 && tree->nr_groups) {
+		tree->compiler = c;
+	} else if (c) {
+		free(c->strings);
+		free(c);
+	}
+
+	if (ret < 0) {
+		cmd_tree_free(tree);
+		return NULL;
+	}
+
+	tree->build_ns = stat_now() - start;
+
+	return tree;
+}
+
+struct cmd_tree *cmd_tree_build(const struct cmd_elem *start, const struct cmd_elem *end)
+{
+	struct cmd_tree *tree;
+
+	tree = cmd_tree_alloc(start, end, false);
+	if (tree == NULL)
+		return NULL;
+
+	return cmd_tree_populate(tree);
+}
+
+/*
+ * Tree image: the compiled arrays written as they are, which works as
+ * every reference inside them is an index or a strtab offset. Elems hold
+ * code pointers so they are not saved, the image instead records a
+ * fingerprint of everything the arrays were compiled from and is only
+ * used by a binary whose elems produce the same one.
+ */
+#define TREE_IMAGE_MAGIC	"CHACTREE"
+#define TREE_IMAGE_VERSION	1
+
+enum {
+	IMG_NODES,
+	IMG_TOKENS,
+	IMG_INDEX,
+	IMG_BINDS,
+	IMG_COMP,
+	IMG_RADIX,
+	IMG_STRTAB,
+	IMG_MAX,
+};
+
+struct tree_image {
+	char magic[8];
+	uint32_t version;
+	uint32_t nr_elems;
+	uint64_t fingerprint;
+	uint64_t size;
+	struct {
+		uint32_t off;	/* from the start of the image, 8 aligned */
+		uint32_t count;
+	} sect[IMG_MAX];
+};
+
+static uint64_t fnv1a(uint64_t hash, const void *data, size_t len)
+{
+	const unsigned char *p = data;
+
+	while (len--)
+		hash = (hash ^ *p++) * 0x100000001b3ULL;
+
+	return hash;
+}
+
+static uint64_t fnv1a_str(uint64_t hash, const char *str)
+{
+	return fnv1a(hash, str ? str : "", str ? strlen(str) + 1 : 1);
+}
+
+static uint64_t tree_fingerprint(struct cmd_tree *tree)
+{
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	uint32_t sizes[] = {
+		TREE_IMAGE_VERSION, sizeof(struct cnode), sizeof(struct ctoken),
+		sizeof(struct centry), sizeof(struct cradix), ARRAY_SIZE(var_types),
+	};
+	const struct cmd_elem *elem;
+	size_t i;
+	int k;
+
+	hash = fnv1a(hash, sizes, sizeof(sizes));
+	for (i = 0; i < ARRAY_SIZE(var_types); i++)
+		hash = fnv1a_str(hash, var_types[i].name);
+
+	for (i = 0; i < tree->nr_elems; i++) {
+		elem = tree->elems[i];
+		hash = fnv1a_str(hash, elem->line);
+		hash = fnv1a_str(hash, elem->desc);
+		if (elem->optattr == NULL)
+			continue;
+		hash = fnv1a(hash, &elem->optattr->size, sizeof(elem->optattr->size));
+		for (k = 0; k < elem->optattr->size; k++)
+			hash = fnv1a_str(hash, elem->optattr->attrs[k].key);
+	}
+
+	return hash;
+}
+
+static int write_full(int fd, const void *buf, size_t len)
+{
+	const char *p = buf;
+	ssize_t n;
+
+	while (len) {
+		n = write(fd, p, len);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		p += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+static const size_t image_esize[IMG_MAX] = {
+	sizeof(struct cnode), sizeof(struct ctoken), sizeof(struct centry), 1,
+	sizeof(uint32_t), sizeof(struct cradix), 1,
+};
+
+/* pass the image of tree to put piece by piece, 0 or what put failed with */
+static int image_write(struct cmd_tree *tree,
+		       int (*put)(void *ctx, const void *buf, size_t len),
+		       void *ctx)
+{
+	struct tree_image hdr;
+	const void *data[IMG_MAX];
+	static const char pad[8];
+	uint64_t off = sizeof(hdr);
+	int i, ret;
+
+	/* binds may move while groups are parsed */
+	tree_expand_all(tree);
+
+	data[IMG_NODES] = tree->nodes;
+	data[IMG_TOKENS] = tree->tokens;
+	data[IMG_INDEX] = tree->index;
+	data[IMG_BINDS] = tree->binds;
+	data[IMG_COMP] = tree->comp;
+	data[IMG_RADIX] = tree->radix;
+	data[IMG_STRTAB] = tree->strtab;
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, TREE_IMAGE_MAGIC, sizeof(hdr.magic));
+	hdr.version = TREE_IMAGE_VERSION;
+	hdr.nr_elems = tree->nr_elems;
+	hdr.fingerprint = tree_fingerprint(tree);
+	hdr.sect[IMG_NODES].count = tree->nr_nodes;
+	hdr.sect[IMG_TOKENS].count = tree->nr_tokens;
+	hdr.sect[IMG_INDEX].count = tree->nr_index;
+	hdr.sect[IMG_BINDS].count = tree->nr_binds;
+	hdr.sect[IMG_COMP].count = tree->nr_comp;
+	hdr.sect[IMG_RADIX].count = tree->nr_radix;
+	hdr.sect[IMG_STRTAB].count = tree->strtab_len;
+
+	for (i = 0; i < IMG_MAX; i++) {
+		hdr.sect[i].off = off;
+		off = (off + hdr.sect[i].count * image_esize[i] + 7) & ~7ULL;
+		if (off > UINT32_MAX)
+			return -EFBIG;
+	}
+	hdr.size = off;
+
+	ret = put(ctx, &hdr, sizeof(hdr));
+	for (i = 0; i < IMG_MAX && ret == 0; i++) {
+		size_t len = hdr.sect[i].count * image_esize[i];
+		size_t end = i + 1 < IMG_MAX ? hdr.sect[i + 1].off : hdr.size;
+
+		ret = put(ctx, data[i], len);
+		if (ret == 0)
+			ret = put(ctx, pad, end - hdr.sect[i].off - len);
+	}
+
+	return ret;
+}
+
+static int image_put_fd(void *ctx, const void *buf, size_t len)
+{
+	return write_full(*(int *)ctx, buf, len);
+}
 
-		if (key && *ptr) {
-			strip_head_blank(&ptr);
-			if (*ptr) {
-				next = ptr;
-				next_end = next + strlen(ptr);
-				strip_tail_blank(next, &next_end);
-			}
-		}
+/* write the image to a temporary file renamed to path, 0 or -errno */
+int cmd_tree_save(struct cmd_tree *tree, const char *path)
+{
+	char tmp[PATH_MAX];
+	int fd, ret;
 
-		if (key && next) {
-			size_t key_len = key_end - key;
+	if (snprintf(tmp, sizeof(tmp), "%s.%d", path, getpid()) >= sizeof(tmp))
+		return -ENAMETOOLONG;
 
-			if (key_len == sizeof("include") - 1 && strncmp(key, "include", key_len) == 0) {
-				handled = 1;
-				*next_end = 0;
-				stream_flush_regexp(term_ostream(term), term_fd(term), next, next_end - next);
-			}
-		}
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		return -errno;
 
-		if (!handled)
-			cmd_pipe(term, &words[i][1]);
-	}
+	ret = image_write(tree, image_put_fd, &fd);
 
-	line_free_args(wordc, words);
+	if (close(fd) < 0 && ret == 0)
+		ret = -errno;
+	if (ret == 0 && rename(tmp, path) < 0)
+		ret = -errno;
+	if (ret < 0)
+		unlink(tmp);
 
 	return ret;
 }
 
-void cmd_complete_free(int ret, char **keys)
+struct image_source {
+	FILE *fp;
+	size_t size;
+};
+
+static int image_put_source(void *ctx, const void *buf, size_t len)
 {
-	if (ret == CMD_COMPLETE_MATCH) {
-		free(keys[0]);
-		free(keys);
-	} else {
-		if (keys)
-			free(keys);
+	struct image_source *src = ctx;
+	const unsigned char *p = buf;
+
+	for (; len; len--, src->size++) {
+		if (fprintf(src->fp, "%s0x%02x,", src->size % 12 ? " " : "\n\t",
+			    *p++) < 0)
+			return -EIO;
 	}
+
+	return 0;
 }
 
-static int cmd_lcd(char **matched)
+/*
+ * Write the image of tree as a C source defining cmd_tree_embedded, the
+ * default tree is then taken from it by the binary it is linked into.
+ * 0 or -errno.
+ */
+int cmd_tree_emit(struct cmd_tree *tree, const char *path)
 {
-	int i;
-	int j;
-	int lcd = -1;
-	char *s1, *s2;
-	char c1, c2;
+	struct image_source src = { .size = 0 };
+	char tmp[PATH_MAX];
+	int ret;
 
-	if (matched[0] == NULL || matched[1] == NULL)
-		return 0;
+	if (snprintf(tmp, sizeof(tmp), "%s.%d", path, getpid()) >= sizeof(tmp))
+		return -ENAMETOOLONG;
+
+	src.fp = fopen(tmp, "w");
+	if (src.fp == NULL)
+		return -errno;
+
+	fprintf(src.fp, "/* the compiled command tree, generated at build time */\n"
+		"#include <stddef.h>\n\n"
+		"const unsigned char cmd_tree_embedded[] "
+		"__attribute__((aligned(8))) = {");
+	ret = image_write(tree, image_put_source, &src);
+	fprintf(src.fp, "\n};\n\nconst size_t cmd_tree_embedded_size = %zu;\n",
+		src.size);
+
+	if (ferror(src.fp) && ret == 0)
+		ret = -EIO;
+	if (fclose(src.fp) && ret == 0)
+		ret = -errno;
+	if (ret == 0 && rename(tmp, path) < 0)
+		ret = -errno;
+	if (ret < 0)
+		unlink(tmp);
 
-	for (i = 1; matched[i] != NULL; i++) {
-		s1 = matched[i - 1];
-		s2 = matched[i];
+	return ret;
+}
 
-		for (j = 0; (c1 = s1[j]) && (c2 = s2[j]); j++)
-			if (c1 != c2)
-				break;
+/* entries [first, first + count) of an array of nr */
+static bool image_range(uint32_t first, uint32_t count, uint32_t nr)
+{
+	return (uint64_t)first + count <= nr;
+}
 
-		if (lcd < 0)
-			lcd = j;
-		else {
-			if (lcd > j)
-				lcd = j;
-		}
-	}
+static bool image_span(struct cmd_tree *tree, uint32_t owner,
+		       const struct cspan *span)
+{
+	if (span->count && (span->node <= owner ||
+			    !image_range(span->node, span->count, tree->nr_nodes)))
+		return false;
 
-	return lcd;
+	return (span->size & (span->size - 1)) == 0 &&
+	       image_range(span->index, span->size, tree->nr_index) &&
+	       image_range(span->wild, span->nr_wild, tree->nr_index);
 }
 
-static int get_complete(struct cmd_node *tree, const char *word, int *n, char ***keys)
+/*
+ * Every index and strtab offset of an attached image is checked once, so
+ * a damaged file is refused rather than followed out of the mapping.
+ * Spans and radix children come after their owner, which also rules out
+ * cycles.
+ */
+static int image_check(struct cmd_tree *tree)
 {
-	size_t len;
-	size_t count;
-	int i, index = 0, lcd;
-	struct token *token;
-	struct cmd_node *node;
-	struct cmd_node *head = tree->children;
-	struct cmd_node *keyword = tree->keyword;
+	const struct cmdoptattr *optattr;
+	const struct cnode *node;
+	const struct ctoken *token;
+	const struct centry *e;
+	const struct cradix *r;
+	uint32_t i, k;
+
+	if (tree->strtab[tree->strtab_len - 1] != '\0')
+		return -EINVAL;
 
-	len = word ? strlen(word) : 0;
+	for (i = 0; i < tree->nr_tokens; i++) {
+		token = &tree->tokens[i];
+		if (token->key >= tree->strtab_len || token->desc >= tree->strtab_len ||
+		    token->type > TOKEN_VARARG || token->vtype > ARRAY_SIZE(var_types))
+			return -EINVAL;
+	}
 
-	count = token_count(head, word, len);
-	count += token_count(keyword, word, len);
-	if (count == 0)
-		return CMD_ERR_NO_MATCH;
+	for (i = 0; i < tree->nr_index; i++) {
+		e = &tree->index[i];
+		if (e->node >= tree->nr_nodes || e->token >= tree->nr_tokens)
+			return -EINVAL;
+	}
 
-	*n = count;
-	*keys = calloc(count + 1, sizeof(char *));
-	if (*keys == NULL)
-		return CMD_ERR_SYSTEM;
+	for (i = 0; i < tree->nr_binds; i++) {
+		if (tree->binds[i] >= CMD_MAXSLOTS && tree->binds[i] != CMD_NOSLOT)
+			return -EINVAL;
+	}
 
-	for_each_node_token(head, node, i, token) {
-		if (!len || strncmp(token->key, word, len) == 0) {
-			(*keys)[index++] = token->key;
-		}
+	for (i = 0; i < tree->nr_comp; i++) {
+		if (tree->comp[i] >= tree->strtab_len)
+			return -EINVAL;
 	}
 
-	for_each_node_token(keyword, node, i, token) {
-		if (!len || strncmp(token->key, word, len) == 0) {
-			(*keys)[index++] = token->key;
+	for (i = 0; i < tree->nr_radix; i++) {
+		r = &tree->radix[i];
+		if (r->lo >= r->hi || r->hi > tree->nr_comp ||
+		    r->depth > strlen(tree->strtab + tree->comp[r->lo]) ||
+		    (r->nr_child && (r->child <= i ||
+				     !image_range(r->child, r->nr_child, tree->nr_radix))))
+			return -EINVAL;
+		for (k = 0; k < 2; k++) {
+			if (r->nr_lit[k] && (r->lit[k].node >= tree->nr_nodes ||
+					     r->lit[k].token >= tree->nr_tokens))
+				return -EINVAL;
 		}
 	}
 
-	lcd = cmd_lcd(*keys);
-	if (lcd && lcd > len) {
-		const char *str = (*keys)[0];
-		char *one;
-
-		one = malloc(lcd + 1);
-		memcpy(one, str, lcd);
-		one[lcd] = '\0';
-		(*keys)[0] = one;
+	for (i = 0; i < tree->nr_nodes; i++) {
+		node = &tree->nodes[i];
+		if ((i && node->parent >= i) || node->group ||
+		    !image_range(node->token, node->nr_tokens, tree->nr_tokens) ||
+		    !image_span(tree, i, &node->children) ||
+		    !image_span(tree, i, &node->keyword) ||
+		    !image_range(node->comp, node->nr_comp, tree->nr_comp) ||
+		    (node->nr_comp && node->radix >= tree->nr_radix))
+			return -EINVAL;
 
-		return CMD_COMPLETE_MATCH;
+		if (node->elem < 0)
+			continue;
+		if (node->elem >= tree->nr_elems)
+			return -EINVAL;
+		optattr = tree->elems[node->elem]->optattr;
+		if (optattr && !image_range(node->bind, optattr->size, tree->nr_binds))
+			return -EINVAL;
 	}
 
-	return count == 1 ? CMD_COMPLETE_FULL_MATCH : CMD_COMPLETE_LIST_MATCH;
+	return 0;
 }
 
-static int _cmd_complete(struct cmd_node *tree, const char *line,
-			 int wordc, char **words, int *n, char ***keys)
+/*
+ * Point the arrays of tree into the image at base, 0 if it is valid and
+ * was built from the elems of the tree.
+ */
+static int tree_attach(struct cmd_tree *tree, void *base, size_t size)
 {
-	struct cmd_node *base = tree;
-	char *argv[1000];
-	int argi = 0, wordi = 0;
-	int ret;
-	const char *word;
-	int _wordc = wordc;
-
-	if (wordc == 0)
-		return CMD_SUCCESS;
+	struct tree_image *hdr = base;
+	int i;
 
-	if (wordc && line[strlen(line)-1] != ' ') {
-		_wordc = wordc - 1;
-	}
+	if (size < sizeof(*hdr) ||
+	    memcmp(hdr->magic, TREE_IMAGE_MAGIC, sizeof(hdr->magic)) ||
+	    hdr->version != TREE_IMAGE_VERSION || hdr->size != size ||
+	    hdr->nr_elems != tree->nr_elems ||
+	    hdr->fingerprint != tree_fingerprint(tree))
+		return -EINVAL;
 
-	if (_wordc > 0) {
-		ret = cmd_search(tree->children, &base, _wordc, words, &wordi, 1024, argv, &argi, NULL);
-		if (ret != 0) {
-			return CMD_ERR_NO_MATCH;
-		}
+	for (i = 0; i < IMG_MAX; i++) {
+		if (hdr->sect[i].off % 8 ||
+		    hdr->sect[i].off + (uint64_t)hdr->sect[i].count * image_esize[i] > hdr->size)
+			return -EINVAL;
 	}
 
-	word = wordi < wordc ? words[wordi] : NULL;
+	if (hdr->sect[IMG_NODES].count == 0 || hdr->sect[IMG_STRTAB].count == 0)
+		return -EINVAL;
 
-	return get_complete(base, word, n, keys);
+	tree->image = base;
+	tree->nodes = (struct cnode *)((char *)base + hdr->sect[IMG_NODES].off);
+	tree->nr_nodes = hdr->sect[IMG_NODES].count;
+	tree->tokens = (struct ctoken *)((char *)base + hdr->sect[IMG_TOKENS].off);
+	tree->nr_tokens = hdr->sect[IMG_TOKENS].count;
+	tree->index = (struct centry *)((char *)base + hdr->sect[IMG_INDEX].off);
+	tree->nr_index = hdr->sect[IMG_INDEX].count;
+	tree->binds = (uint8_t *)base + hdr->sect[IMG_BINDS].off;
+	tree->nr_binds = hdr->sect[IMG_BINDS].count;
+	tree->comp = (uint32_t *)((char *)base + hdr->sect[IMG_COMP].off);
+	tree->nr_comp = hdr->sect[IMG_COMP].count;
+	tree->radix = (struct cradix *)((char *)base + hdr->sect[IMG_RADIX].off);
+	tree->nr_radix = hdr->sect[IMG_RADIX].count;
+	tree->strtab = (char *)base + hdr->sect[IMG_STRTAB].off;
+	tree->strtab_len = hdr->sect[IMG_STRTAB].count;
+
+	return image_check(tree);
 }
 
-int cmd_complete(struct cmd_node *tree, const char *line, int *n, char ***keys)
+/*
+ * Map an image saved by cmd_tree_save() read only, the pages are shared
+ * by every process mapping the same file. Returns NULL if the image is
+ * missing, damaged or was built from other elems than common_cmds and
+ * [start, end).
+ */
+struct cmd_tree *cmd_tree_load(const char *path, const struct cmd_elem *start,
+			       const struct cmd_elem *end)
 {
-	int ret;
-	int i, wordc;
-	char **words;
+	struct cmd_tree *tree;
+	struct stat st;
+	void *base;
+	int fd;
 
-	wordc = line_get_args(line, &words);
-	if (wordc < 0)
-		return CMD_ERR_SYSTEM;
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return NULL;
 
-	for (i = 0; i < wordc; i++) {
-		if (words[i][0] == '|')
-			return CMD_SUCCESS;
+	if (fstat(fd, &st) < 0 || st.st_size < sizeof(struct tree_image)) {
+		close(fd);
+		return NULL;
 	}
 
-	ret = _cmd_complete(tree, line, wordc, words, n, keys);
-	line_free_args(wordc, words);
-	return ret;
+	base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (base == MAP_FAILED)
+		return NULL;
+
+	tree = cmd_tree_alloc(start, end, false);
+	if (tree == NULL || tree_attach(tree, base, st.st_size) < 0) {
+		if (tree)
+			cmd_tree_free(tree);
+		munmap(base, st.st_size);
+		return NULL;
+	}
+
+	tree->image_size = st.st_size;
+
+	return tree;
 }
 
-void cmd_describe_free(int ret, char **keys, char **descs)
+struct cmd_tree *cmd_tree_get(struct cmd_tree *tree)
 {
-	if (keys)
-		free(keys);
-	if (descs)
-		free(descs);
+	if (tree)
+		tree->refcnt++;
+
+	return tree;
 }
 
-static int alloc_desc(size_t count, char ***keys, char ***descs)
+/* the registry holds a reference of its own */
+static struct cmd_tree *default_tree;
+static uint32_t default_version;
+
+void cmd_tree_put(struct cmd_tree *tree)
 {
-	*keys = calloc(count + 1, sizeof(char *));
-	if (*keys == NULL)
-		return -ENOMEM;
-	*descs = calloc(count + 1, sizeof(char *));
-	if (*descs == NULL)
-		return -ENOMEM;
+	if (tree == NULL || --tree->refcnt > 0)
+		return;
 
-	return 0;
+	cmd_tree_free(tree);
 }
 
-static int get_desc(struct cmd_node *tree, const char *word, int *n,
-		    char ***keys, char ***descs)
+int cmd_tree_refcnt(struct cmd_tree *tree)
 {
-	size_t count;
-	size_t len;
-	int index = 0;
-	struct cmd_node *node;
-	struct token *token;
-	int i;
-	struct cmd_node *head = tree->children;
-	struct cmd_node *keyword = tree->keyword;
+	return tree->refcnt;
+}
 
-	len = word ? strlen(word) : 0;
+static const char *default_image;
 
-	count  = token_count(head, word, len);
-	count += token_count(keyword, word, len);
-	if (count <= 0)
-		return CMD_ERR_NO_MATCH;
+/* defined by the source cmd_tree_emit() generates if it is linked in */
+extern const unsigned char cmd_tree_embedded[] __attribute__((weak));
+extern const size_t cmd_tree_embedded_size __attribute__((weak));
 
-	*n = count;
-	if (alloc_desc(count, keys, descs) < 0)
-		return CMD_ERR_SYSTEM;
+static struct cmd_tree *default_embedded(void)
+{
+	static bool warned;
+	struct cmd_tree *tree;
 
-	for_each_node_token(head, node, i, token) {
-		if (!len || strncmp(token->key, word, len) == 0) {
-			(*keys)[index] = token->key;
-			(*descs)[index] = token->desc;
-			index++;
-		}
-	}
+	if (cmd_tree_embedded == NULL)
+		return NULL;
 
-	for_each_node_token(keyword, node, i, token) {
-		if (!len || strncmp(token->key, word, len) == 0) {
-			(*keys)[index] = token->key;
-			(*descs)[index] = token->desc;
-			index++;
-		}
+	tree = cmd_tree_alloc(&__start_cmd_section, &__stop_cmd_section, false);
+	if (tree && tree_attach(tree, (void *)cmd_tree_embedded,
+				cmd_tree_embedded_size) < 0) {
+		/* a stale cmd-image.c or one generated for another ABI */
+		if (!warned)
+			fprintf(stderr, "embedded command tree does not match, building it\n");
+		warned = true;
+		cmd_tree_free(tree);
+		return NULL;
 	}
 
-	return count == 1 ? CMD_COMPLETE_FULL_MATCH : CMD_COMPLETE_LIST_MATCH;
+	return tree;
 }
 
-static int _cmd_describe(struct cmd_node *tree, const char *line, int wordc,
-			 char **words, int *n, char ***keys, char ***descs, int *cr)
+/*
+ * The default tree is mapped from path when the image there matches
+ * cmd_section, otherwise it is taken from the embedded image if any or
+ * built and saved to path for the next run.
+ */
+void cmd_tree_set_image(const char *path)
 {
-	struct cmd_node *base = tree;
-	char *argv[1000];
-	int argi = 0, wordi = 0;
-	int i, ret;
-	const char *word;
-	int _wordc = wordc;
+	default_image = path;
+}
 
-	if (wordc && line[strlen(line)-1] != ' ') {
-		_wordc = wordc - 1;
-	}
+static struct cmd_tree *default_build(void)
+{
+	struct cmd_tree *tree;
 
-	if (_wordc > 0) {
-		ret = cmd_search(tree->children, &base, _wordc, words, &wordi, 1024, argv, &argi, NULL);
-		if (ret != 0) {
-			return CMD_ERR_NO_MATCH;
-		}
-	}
+	tree = cmd_tree_alloc(&__start_cmd_section, &__stop_cmd_section, true);
+	if (tree == NULL)
+		return NULL;
 
-	word = wordi < wordc ? words[wordi] : NULL;
-	*cr = _wordc == wordc && base->func ? 1 : 0;
+	tree = cmd_tree_populate(tree);
+	if (tree)
+		tree->version = ++default_version;
+
+	return tree;
+}
 
-	ret = get_desc(base, word, n, keys, descs);
+/*
+ * Returns a reference to the process wide tree built from cmd_section
+ * and the registered modules, building it on first use.
+ */
+struct cmd_tree *cmd_tree_get_default(void)
+{
+	int ret;
 
-	if (word) {
-		for (i = 0; i < *n; i++) {
-			if (strcmp(word, (*keys)[i]) == 0) {
-				if (base->func)
-					*cr = 1;
-				break;
-			}
+	if (default_tree)
+		return cmd_tree_get(default_tree);
+
+	/* an image only covers cmd_section */
+	if (modules == NULL) {
+		if (default_image)
+			default_tree = cmd_tree_load(default_image,
+						     &__start_cmd_section,
+						     &__stop_cmd_section);
+		if (default_tree == NULL)
+			default_tree = default_embedded();
+		if (default_tree) {
+			default_tree->version = ++default_version;
+			return cmd_tree_get(default_tree);
 		}
 	}
 
-	return ret;
+	default_tree = default_build();
+
+	if (default_tree && default_image && modules == NULL) {
+		ret = cmd_tree_save(default_tree, default_image);
+		if (ret < 0)
+			fprintf(stderr, "%s: %s\n", default_image, strerror(-ret));
+	}
+
+	return cmd_tree_get(default_tree);
 }
 
-int cmd_describe(struct cmd_node *tree, const char *line, int *n,
-		 char ***keys, char ***descs, int *cr)
+/*
+ * Build the default tree again from the registered modules and swap it
+ * in. Sessions move to it between commands by cmd_tree_update(), the old
+ * tree is freed once the last of them has. Statistics are kept for the
+ * elems which stay at the same place.
+ */
+int cmd_tree_reload(void)
 {
-	int ret;
-	int i, wordc;
-	char **wordv;
+	struct cmd_tree *tree, *old = default_tree;
+	size_t i;
 
-	wordc = line_get_args(line, &wordv);
-	if (wordc < 0)
-		return CMD_ERR_NO_MATCH;
+	tree = default_build();
+	if (tree == NULL)
+		return -ENOMEM;
 
-	for (i = 0; i < wordc; i++) {
-		if (wordv[i][0] == '|')
-			return CMD_SUCCESS;
+	for (i = 0; old && i < old->nr_elems && i < tree->nr_elems; i++) {
+		if (old->elems[i] != tree->elems[i])
+			break;
+		tree->stats[i] = old->stats[i];
 	}
 
-	ret = _cmd_describe(tree, line, wordc, wordv, n, keys, descs, cr);
-	line_free_args(wordc, wordv);
+	default_tree = tree;
+	/* cached outputs are keyed by elems of the old tree */
+	output_cache_clear();
+	cmd_tree_put(old);
 
-	return ret;
+	return 0;
 }
 
-extern const struct cmd_elem __start_cmd_section, __stop_cmd_section;
-
-static int elem_compare(const void *a, const void *b)
+/*
+ * Move a reference of a former default tree to the current one, trees
+ * built otherwise are left alone. Called by sessions before a command.
+ */
+struct cmd_tree *cmd_tree_update(struct cmd_tree **tree)
 {
-	const struct cmd_elem **ea = (const struct cmd_elem **)a;
-	const struct cmd_elem **eb = (const struct cmd_elem **)b;
+	if ((*tree)->version && default_tree && *tree != default_tree) {
+		cmd_tree_put(*tree);
+		*tree = cmd_tree_get(default_tree);
+	}
 
-	return strcmp((*ea)->line, (*eb)->line);
+	return *tree;
 }
 
-/* The command syntax represented by line is from Quagga and gets simplified. */
+/*
+ * Add the elems [start, end) under name, they are part of the default
+ * tree from the next cmd_tree_reload(). The elems must stay valid until
+ * the module is unregistered and no tree refers to it.
+ */
+int cmd_register(const char *name, const struct cmd_elem *start,
+		 const struct cmd_elem *end)
+{
+	struct cmd_module *mod, **pp;
 
-#define COMMON_COMMAND(func, line, desc)				\
-	static int func(struct term *term, struct cmdopt *opt);		\
-									\
-	struct cmd_elem cmd_common_##func = {				\
-		line, desc, func					\
-	};								\
-									\
-	static int func(struct term *term, struct cmdopt *opt)
+	for (pp = &modules; *pp; pp = &(*pp)->next) {
+		if (strcmp((*pp)->name, name) == 0)
+			return -EEXIST;
+	}
 
-COMMON_COMMAND(list_commands,
-	"list",
-	"List all defined commands\n")
-{
-	cmd_list_elems(term_ostream(term));
+	mod = calloc(1, sizeof(*mod));
+	if (mod == NULL)
+		return -ENOMEM;
 
-	return 0;
-}
+	mod->name = strdup(name);
+	if (mod->name == NULL) {
+		free(mod);
+		return -ENOMEM;
+	}
 
-COMMON_COMMAND(quit_terminal,
-	"quit",
-	"Exit current terminal\n")
-{
-	stream_putc(term_ostream(term), 4);
-	term_flush(term);
-	term_quit(term);
+	mod->refcnt = 1;
+	mod->start = start;
+	mod->end = end;
+	*pp = mod;
 
 	return 0;
 }
 
-COMMON_COMMAND(exit_terminal,
-	"exit",
-	"Exit current terminal\n")
+int cmd_unregister(const char *name)
 {
-	term_flush(term);
-	term_quit(term);
+	struct cmd_module *mod, **pp;
 
-	return 0;
-}
+	for (pp = &modules; *pp; pp = &(*pp)->next) {
+		if (strcmp((*pp)->name, name) == 0)
+			break;
+	}
 
-static const struct cmd_elem *common_cmds[] = {
-	&cmd_common_list_commands,
-	&cmd_common_quit_terminal,
-	&cmd_common_exit_terminal,
-	NULL
-};
+	mod = *pp;
+	if (mod == NULL)
+		return -ENOENT;
 
-#ifndef ARRAY_SIZE
-#define ARRAY_SIZE(arr)	sizeof(arr) / sizeof(arr[0])
-#endif
+	*pp = mod->next;
+	module_put(mod);
+
+	return 0;
+}
 
-void cmd_list_elems(struct stream *out)
+/*
+ * Open a shared object declaring CMD_PLUGIN() and register the elems of
+ * its cmd_section under path, then reload the default tree. The object
+ * refers to the functions of chaconne, which is linked with -rdynamic.
+ */
+int cmd_plugin_load(const char *path, char *err, size_t size)
 {
-	const struct cmd_elem *start = &__start_cmd_section;
-	const struct cmd_elem *end = &__stop_cmd_section;
-	const struct cmd_elem **array;
-	size_t i, nr_cmds = end - start;
-	size_t nr_comm = ARRAY_SIZE(common_cmds) - 1;
-	size_t count = nr_comm + nr_cmds;
+	const struct cmd_elem *(*elems)(const struct cmd_elem **end);
+	const struct cmd_elem *start = NULL, *end = NULL;
+	struct cmd_module *mod;
+	void *handle;
+	int ret;
 
-	array = malloc(count  * sizeof(struct cmd_elem *));
-	if (array == NULL) {
-		return;
+	handle = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+	if (handle == NULL) {
+		snprintf(err, size, "%s", dlerror());
+		return -ENOENT;
 	}
 
-	for (i = 0; i < nr_comm; i++)
-		array[i] = common_cmds[i];
+	elems = (const struct cmd_elem *(*)(const struct cmd_elem **))
+		dlsym(handle, "cmd_plugin_elems");
+	if (elems)
+		start = elems(&end);
+	if (start == NULL || start >= end) {
+		snprintf(err, size, "no commands in %s", path);
+		dlclose(handle);
+		return -EINVAL;
+	}
 
-	for (i = 0; i < nr_cmds; i++) {
-		array[nr_comm + i] = start + i;
+	ret = cmd_register(path, start, end);
+	if (ret < 0) {
+		snprintf(err, size, "%s", strerror(-ret));
+		dlclose(handle);
+		return ret;
 	}
 
-	qsort(array + nr_comm, nr_cmds, sizeof(void *), elem_compare);
+	for (mod = modules; mod->next; mod = mod->next)
+		;
+	mod->handle = handle;
 
-	for (i = 0; i < count; i++) {
-		stream_puts(out, "  %s\r\n", array[i]->line);
+	ret = cmd_tree_reload();
+	if (ret < 0) {
+		snprintf(err, size, "%s", strerror(-ret));
+		cmd_unregister(path);
 	}
+
+	return ret;
 }
 
-struct cmd_node *cmd_tree_build(const struct cmd_elem *start, const struct cmd_elem *end)
+/* unregister a plugin and reload, it is closed with the last old tree */
+int cmd_plugin_unload(const char *path)
 {
-	const struct cmd_elem *elem;
-	struct cmd_node *tree;
-	size_t i, nr_comm = ARRAY_SIZE(common_cmds) - 1;
-
-	tree = calloc(1, sizeof(struct cmd_node));
-	if (tree == NULL)
-		return NULL;
-
-	for (i = 0 ; i < nr_comm; i++) {
-		if (cmd_add_elem(tree, common_cmds[i]) < 0) {
-			printf("failed to add '%s'\r\n", common_cmds[i]->line);
-		}
-	}
+	int ret;
 
-	for (elem = start; elem < end; elem++) {
-		if (cmd_add_elem(tree, elem) < 0) {
-			printf("failed to add '%s'\r\n", elem->line);
-		}
-	}
+	ret = cmd_unregister(path);
+	if (ret < 0)
+		return ret;
 
-	return tree;
+	return cmd_tree_reload();
 }
 
-struct cmd_node *cmd_tree_build_default(void)
+void cmd_modules_show(struct stream *out)
 {
-	return cmd_tree_build(&__start_cmd_section, &__stop_cmd_section);
+	struct cmd_module *mod;
+
+	stream_puts(out, "tree version %u\r\n", default_version);
+	for (mod = modules; mod; mod = mod->next)
+		stream_puts(out, "%-32s %-10s %5zu commands, %d refs\r\n",
+			    mod->name, mod->handle ? "plugin" : "registered",
+			    (size_t)(mod->end - mod->start), mod->refcnt);
 }
@@ -4,10 +4,39 @@
 
 #include "cpuid.h"
 #include "cli-term.h"
-#include "hashtable.h"
 #include "range.h"
 
-COMMAND(cmd_cpuid, NULL,
+struct cpuidopt {
+	const char *eax;
+	const char *ecx;
+};
+
+static struct cpuidopt cpuidopt;
+
+static struct optattr cpuid_attrs[] = {
+	{
+		.index = -1,
+		.key = "-eax",
+		.offset = offsetof(struct cpuidopt, eax),
+		.set = set_strptr,
+	},
+	{
+		.index = -1,
+		.key = "-ecx",
+		.offset = offsetof(struct cpuidopt, ecx),
+		.set = set_strptr,
+	},
+};
+
+static struct cmdoptattr cpuid_optattr = {
+	.attrs = cpuid_attrs,
+	.size = sizeof(cpuid_attrs)/sizeof(cpuid_attrs[0]),
+	.buf = &cpuidopt,
+	.bufsize = sizeof(struct cpuidopt),
+};
+
+/* the leaves do not change while running */
+COMMAND_CACHED(cmd_cpuid, &cpuid_optattr, 60000,
 	"cpuid {-eax UINT|-ecx UINT}",
 	"cpuid command\n"
 	"eax option for cpuid\n"
@@ -17,8 +46,8 @@ COMMAND(cmd_cpuid, NULL,
 	)
 {
 	struct cpuidreg id;
-	const char *eaxstr = hashtable_get(opt->kpairs, "-eax");
-	const char *ecxstr = hashtable_get(opt->kpairs, "-ecx");
+	const char *eaxstr = cpuidopt.eax;
+	const char *ecxstr = cpuidopt.ecx;
 	uint32_t eax, ecx = 0;
 
 	if (!eaxstr) {
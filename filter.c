@@ -0,0 +1,438 @@
+/*
+ * Output Filter Chain
+ *
+ * Copyright (c) 2021 Jiajia Liu <liujia6264@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+
+#include "filter.h"
+#include "stream.h"
+#include "arena.h"
+#include "libregexp.h"
+#include "regexp-cache.h"
+
+#define FILTER_DEFAULT_LINES	10
+#define FILTER_MAX_LINES	100000
+
+struct filter_stage;
+
+struct filter_ops {
+	const char *name;
+	int has_regexp;
+	int has_number;
+	int (*line)(struct filter_stage *f, const char *line, size_t len);
+	int (*end)(struct filter_stage *f);
+};
+
+struct filter_line {
+	char *str;
+	size_t len;
+	size_t size;
+};
+
+struct filter_stage {
+	const struct filter_ops *ops;
+	struct filter_chain *chain;
+	struct filter_stage *next;
+
+	struct regexp *re;
+	uint8_t **capture;
+	long number;
+
+	unsigned long count;
+	int begun;
+
+	/* sort keeps all lines, tail a ring of the last number lines */
+	struct filter_line *lines;
+	unsigned long nr_lines, alloc_lines;
+};
+
+struct filter_chain {
+	struct arena *arena;
+	struct filter_stage *first;
+	struct stream *out;
+};
+
+static int filter_emit(struct filter_stage *f, const char *line, size_t len)
+{
+	if (f->next)
+		return f->next->ops->line(f->next, line, len);
+
+	stream_put(f->chain->out, line, len);
+	return stream_put(f->chain->out, "\r\n", 2);
+}
+
+static int filter_match(struct filter_stage *f, const char *line, size_t len)
+{
+	return lre_exec(f->capture, f->re->bc, (const uint8_t *)line, 0, len, 0, NULL) == 1;
+}
+
+static int include_line(struct filter_stage *f, const char *line, size_t len)
+{
+	return filter_match(f, line, len) ? filter_emit(f, line, len) : 0;
+}
+
+static int exclude_line(struct filter_stage *f, const char *line, size_t len)
+{
+	return filter_match(f, line, len) ? 0 : filter_emit(f, line, len);
+}
+
+static int begin_line(struct filter_stage *f, const char *line, size_t len)
+{
+	if (!f->begun && !filter_match(f, line, len))
+		return 0;
+
+	f->begun = 1;
+	return filter_emit(f, line, len);
+}
+
+static int count_line(struct filter_stage *f, const char *line, size_t len)
+{
+	f->count++;
+	return 0;
+}
+
+static int count_end(struct filter_stage *f)
+{
+	char buf[32];
+
+	return filter_emit(f, buf, snprintf(buf, sizeof(buf), "%lu", f->count));
+}
+
+/* nothing after the head is needed, stop the walk early */
+static int head_line(struct filter_stage *f, const char *line, size_t len)
+{
+	if (f->count >= f->number)
+		return -ECANCELED;
+
+	f->count++;
+	return filter_emit(f, line, len);
+}
+
+/*
+ * Lines of sort and tail are copied into the arena since the stream
+ * node they live in is released while walking. A tail slot keeps its
+ * buffer and only gets a new one when a longer line comes in.
+ */
+static int keep_line(struct filter_stage *f, unsigned long idx,
+		     const char *line, size_t len)
+{
+	struct filter_line *l = &f->lines[idx];
+	char *str;
+
+	if (l->str == NULL || l->size <= len) {
+		str = arena_alloc(f->chain->arena, len + 1);
+		if (str == NULL)
+			return -ENOMEM;
+		l->str = str;
+		l->size = len + 1;
+	}
+
+	memcpy(l->str, line, len);
+	l->str[len] = '\0';
+	l->len = len;
+
+	return 0;
+}
+
+static int tail_line(struct filter_stage *f, const char *line, size_t len)
+{
+	if (f->number == 0)
+		return 0;
+
+	return keep_line(f, f->count++ % f->number, line, len);
+}
+
+static int tail_end(struct filter_stage *f)
+{
+	unsigned long i, start = 0, n = f->count;
+	int ret = 0;
+
+	if (n > f->number) {
+		start = f->count % f->number;
+		n = f->number;
+	}
+
+	for (i = 0; i < n && ret >= 0; i++) {
+		struct filter_line *l = &f->lines[(start + i) % f->number];
+
+		ret = filter_emit(f, l->str, l->len);
+	}
+
+	return ret;
+}
+
+/* the array of sort grows on the heap, the old ones would pile up in the arena */
+static int sort_line(struct filter_stage *f, const char *line, size_t len)
+{
+	if (f->nr_lines == f->alloc_lines) {
+		unsigned long alloc = f->alloc_lines ? f->alloc_lines * 2 : 64;
+		struct filter_line *lines;
+
+		lines = realloc(f->lines, alloc * sizeof(*lines));
+		if (lines == NULL)
+			return -ENOMEM;
+
+		f->lines = lines;
+		f->alloc_lines = alloc;
+	}
+
+	f->lines[f->nr_lines].str = NULL;
+	return keep_line(f, f->nr_lines++, line, len);
+}
+
+static int line_cmp(const void *a, const void *b)
+{
+	const struct filter_line *l1 = a, *l2 = b;
+	size_t len = l1->len < l2->len ? l1->len : l2->len;
+	int r;
+
+	r = memcmp(l1->str, l2->str, len);
+	if (r)
+		return r;
+
+	return l1->len < l2->len ? -1 : l1->len > l2->len;
+}
+
+static int sort_end(struct filter_stage *f)
+{
+	unsigned long i;
+	int ret = 0;
+
+	qsort(f->lines, f->nr_lines, sizeof(struct filter_line), line_cmp);
+
+	for (i = 0; i < f->nr_lines && ret >= 0; i++)
+		ret = filter_emit(f, f->lines[i].str, f->lines[i].len);
+
+	return ret;
+}
+
+static const struct filter_ops filter_ops[] = {
+	{ "include", 1, 0, include_line, NULL },
+	{ "exclude", 1, 0, exclude_line, NULL },
+	{ "begin",   1, 0, begin_line,   NULL },
+	{ "count",   0, 0, count_line,   count_end },
+	{ "head",    0, 1, head_line,    NULL },
+	{ "tail",    0, 1, tail_line,    tail_end },
+	{ "sort",    0, 0, sort_line,    sort_end },
+};
+
+static const char *next_stage(const char *p, const char **end)
+{
+	const char *q;
+
+	while (isspace(*p))
+		p++;
+	if (*p != '|')
+		return NULL;
+	p++;
+
+	for (q = p; *q; q++)
+		if (*q == '|' && isspace(q[-1]))
+			break;
+
+	*end = q;
+	return p;
+}
+
+static int stage_init(struct filter_chain *chain, struct filter_stage *f,
+		      const char *p, const char *end, char *err, size_t errlen)
+{
+	const struct filter_ops *ops = NULL;
+	const char *name;
+	size_t len;
+	int i;
+
+	while (p < end && isspace(*p))
+		p++;
+	while (end > p && isspace(end[-1]))
+		end--;
+
+	for (name = p; p < end && !isspace(*p); p++)
+		;
+	len = p - name;
+	while (p < end && isspace(*p))
+		p++;
+
+	for (i = 0; i < sizeof(filter_ops) / sizeof(filter_ops[0]); i++) {
+		if (strlen(filter_ops[i].name) == len &&
+		    !strncmp(filter_ops[i].name, name, len)) {
+			ops = &filter_ops[i];
+			break;
+		}
+	}
+
+	if (ops == NULL)
+		return -ENOENT;
+
+	memset(f, 0, sizeof(*f));
+	f->ops = ops;
+	f->chain = chain;
+
+	if (ops->has_regexp) {
+		if (p == end) {
+			snprintf(err, errlen, "%s needs a regular expression", ops->name);
+			return -EINVAL;
+		}
+
+		f->re = regexp_get(p, end - p, 0, err, errlen);
+		if (f->re == NULL)
+			return -EINVAL;
+
+		f->capture = arena_calloc(chain->arena, f->re->capture_count * 2,
+					  sizeof(uint8_t *));
+		if (f->capture == NULL) {
+			regexp_put(f->re);
+			return -ENOMEM;
+		}
+	} else if (ops->has_number) {
+		char *num_end;
+
+		f->number = FILTER_DEFAULT_LINES;
+		if (p < end) {
+			/* as in "head -5", leave it to the shell */
+			if (!isdigit(*p))
+				return -ENOENT;
+			errno = 0;
+			f->number = strtol(p, &num_end, 10);
+			if (num_end != end)
+				return -ENOENT;
+			if (errno == ERANGE || f->number > FILTER_MAX_LINES) {
+				snprintf(err, errlen, "%s takes at most %d lines",
+					 ops->name, FILTER_MAX_LINES);
+				return -EINVAL;
+			}
+		}
+
+		if (ops->line == tail_line && f->number) {
+			f->lines = arena_calloc(chain->arena, f->number, sizeof(*f->lines));
+			if (f->lines == NULL)
+				return -ENOMEM;
+		}
+	} else if (p < end) {
+		return -ENOENT;
+	}
+
+	return 0;
+}
+
+int filter_chain_parse(struct arena *arena, const char *spec,
+		       struct filter_chain **chain, const char **rest,
+		       char *err, size_t errlen)
+{
+	struct filter_chain *c;
+	struct filter_stage *f, **pp;
+	const char *p, *end;
+	int ret;
+
+	c = arena_calloc(arena, 1, sizeof(*c));
+	if (c == NULL)
+		return -ENOMEM;
+
+	c->arena = arena;
+	pp = &c->first;
+	*rest = NULL;
+
+	while ((p = next_stage(spec, &end))) {
+		f = arena_alloc(arena, sizeof(*f));
+		if (f == NULL) {
+			ret = -ENOMEM;
+			goto err;
+		}
+
+		/* the built-in stages run first, the shell gets the others */
+		ret = stage_init(c, f, p, end, err, errlen);
+		if (ret == -ENOENT && c->first) {
+			*rest = p - 1;
+			break;
+		} else if (ret < 0) {
+			goto err;
+		}
+
+		*pp = f;
+		pp = &f->next;
+		spec = end;
+	}
+
+	if (c->first == NULL) {
+		ret = -ENOENT;
+		goto err;
+	}
+
+	*chain = c;
+	return 0;
+
+err:
+	filter_chain_free(c);
+	return ret;
+}
+
+static int chain_line(void *data, const char *line, size_t len)
+{
+	struct filter_stage *f = data;
+
+	return f->ops->line(f, line, len);
+}
+
+/* replace the content of s with the filtered lines */
+int filter_chain_run(struct filter_chain *chain, struct stream *s)
+{
+	struct filter_stage *f;
+	int ret;
+
+	chain->out = stream_new();
+	if (chain->out == NULL)
+		return -ENOMEM;
+
+	/* -ECANCELED from head only means the stages before it may stop */
+	ret = stream_for_each_line(s, chain_line, chain->first);
+	for (f = chain->first; f && (ret >= 0 || ret == -ECANCELED); f = f->next) {
+		if (f->ops->end)
+			ret = f->ops->end(f);
+	}
+	if (ret == -ECANCELED)
+		ret = 0;
+
+	stream_append(s, chain->out);
+	stream_free(chain->out);
+	chain->out = NULL;
+
+	return ret;
+}
+
+/* the chain itself lives in the arena, only the regexps and sort lines are held */
+void filter_chain_free(struct filter_chain *chain)
+{
+	struct filter_stage *f;
+
+	for (f = chain->first; f; f = f->next) {
+		if (f->re)
+			regexp_put(f->re);
+		if (f->ops->line == sort_line)
+			free(f->lines);
+	}
+}
@@ -0,0 +1,62 @@
+/*
+ * Output Filter Chain
+ *
+ * Copyright (c) 2021 Jiajia Liu <liujia6264@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef _FILTER_H_
+#define _FILTER_H_
+
+#include <stddef.h>
+
+struct arena;
+struct stream;
+
+/*
+ * Built-in output pipes, e.g. "| exclude down | begin eth | head 5".
+ *
+ *	include REGEX	lines matching REGEX
+ *	exclude REGEX	lines not matching REGEX
+ *	begin REGEX	lines from the first one matching REGEX
+ *	count		number of lines
+ *	head [N]	first N lines, 10 by default, at most 100000
+ *	tail [N]	last N lines, 10 by default, at most 100000
+ *	sort		lines in byte order
+ *
+ * A stage starts at a '|' at the beginning of the spec or after a blank,
+ * so REGEX may still use alternation as in "include up|down". Arguments
+ * the filters do not take, as in "sort -n", make it a shell pipe. The
+ * leading built-in stages always run in process, in "| include x | wc"
+ * only "| wc" is left in rest for the shell.
+ */
+struct filter_chain;
+
+/*
+ * -ENOENT if the first stage is not a built-in filter, -EINVAL with err
+ * filled. rest is NULL or the first stage that is not built-in.
+ */
+int filter_chain_parse(struct arena *arena, const char *spec,
+		       struct filter_chain **chain, const char **rest,
+		       char *err, size_t errlen);
+int filter_chain_run(struct filter_chain *chain, struct stream *s);
+void filter_chain_free(struct filter_chain *chain);
+
+#endif
@@ -15,6 +15,7 @@
 
 #include "cli-term.h"
 #include "event-loop.h"
+#include "stream.h"
 
 static struct termios new, old;
 
@@ -137,6 +138,8 @@ int server_create(uint16_t port)
 }
 
 #define MAX_NR_CLIENTS	8
+#define ZEBRA_PORT	2601
+#define MACHINE_PORT	2602
 
 struct zebra_server {
 	struct event_source *source;
@@ -146,6 +149,15 @@ struct zebra_server {
 	struct term *clients[MAX_NR_CLIENTS];
 };
 
+/* clients in machine mode, see cli-machine.c */
+struct machine_server {
+	struct event_source *source;
+	struct event_loop *loop;
+	int fd;
+
+	struct machine *clients[MAX_NR_CLIENTS];
+};
+
 static void zebra_server_destroy(struct zebra_server *srv)
 {
 	int i, fd;
@@ -200,14 +212,146 @@ static int zebra_accept(int fd, uint32_t mask, void *data)
 	return 0;
 }
 
+static void machine_server_destroy(struct machine_server *srv)
+{
+	int i, fd;
+
+	if (srv->fd < 0)
+		return;
+
+	for (i = 0; i < MAX_NR_CLIENTS; i++) {
+		if (srv->clients[i]) {
+			fd = machine_fd(srv->clients[i]);
+			machine_destroy(srv->clients[i]);
+			close(fd);
+		}
+	}
+
+	event_source_remove(srv->source);
+	close(srv->fd);
+}
+
+static int machine_accept(int fd, uint32_t mask, void *data)
+{
+	int cfd, i;
+	struct sockaddr_in sin;
+	socklen_t socklen = sizeof(sin);
+	struct machine *m;
+	struct machine_server *srv = data;
+
+	cfd = accept(fd, (struct sockaddr *)&sin, &socklen);
+	if (cfd == -1) {
+		perror("accept");
+		return -errno;
+	}
+
+	for (i = 0; i < MAX_NR_CLIENTS; i++) {
+		if (srv->clients[i] == NULL)
+			break;
+	}
+
+	if (i == MAX_NR_CLIENTS) {
+		close(cfd);
+		return 0;
+	}
+
+	m = machine_create(srv->loop, cfd);
+	if (m == NULL) {
+		printf("failed to create machine session\n");
+		close(cfd);
+		return -1;
+	}
+
+	srv->clients[i] = m;
+
+	return 0;
+}
+
+extern const struct cmd_elem __start_cmd_section, __stop_cmd_section;
+
+/* chaconne -g SOURCE: write the compiled tree of cmd_section as C */
+static int emit_tree(const char *path)
+{
+	struct cmd_tree *tree;
+	int ret;
+
+	tree = cmd_tree_build(&__start_cmd_section, &__stop_cmd_section);
+	if (tree == NULL)
+		return 1;
+
+	ret = cmd_tree_emit(tree, path);
+	if (ret < 0)
+		fprintf(stderr, "%s: %s\n", path, strerror(-ret));
+
+	cmd_tree_put(tree);
+
+	return ret ? 1 : 0;
+}
+
+/* chaconne -f SCRIPT: run the script to stdout and exit */
+static int run_script(const char *path, int flags)
+{
+	struct cmd_source_stats st;
+	struct cmd_tree *tree;
+	struct stream *out;
+	int ret;
+
+	tree = cmd_tree_get_default();
+	out = stream_new();
+	if (tree == NULL || out == NULL)
+		return 1;
+
+	ret = cmd_source(tree, path, flags, out, STDOUT_FILENO, &st);
+	if (ret < 0)
+		fprintf(stderr, "%s: %s\n", path, strerror(-ret));
+	else
+		fprintf(stderr, "%lu commands, %lu failed in %.3f s, %.0f commands/s\n",
+			st.commands, st.failed, st.seconds,
+			st.seconds > 0 ? st.commands / st.seconds : 0);
+
+	stream_free(out);
+	cmd_tree_put(tree);
+
+	return ret ? 1 : 0;
+}
+
 int main(int argc, char *argv[])
 {
 	int i;
 	struct term *term;
 	struct event_loop *loop;
 	struct zebra_server zebra;
+	struct machine_server machine;
+	const char *script = NULL;
+	int c, flags = 0;
+
+	while ((c = getopt(argc, argv, "f:g:kt:")) != -1) {
+		switch (c) {
+		case 'f':
+			script = optarg;
+			break;
+		case 'g':
+			return emit_tree(optarg);
+		case 'k':
+			flags |= CMD_SOURCE_CONTINUE;
+			break;
+		case 't':
+			cmd_tree_set_image(optarg);
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-g SOURCE] [-t IMAGE] [-f SCRIPT [-k]]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	/* a pipe command or a client going away is seen as EPIPE */
+	signal(SIGPIPE, SIG_IGN);
+
+	if (script)
+		return run_script(script, flags);
 
 	memset(&zebra, 0, sizeof(zebra));
+	memset(&machine, 0, sizeof(machine));
 
 	signal(SIGQUIT, handle_signal);
 	signal(SIGINT, handle_signal);
@@ -228,13 +372,25 @@ int main(int argc, char *argv[])
 	if (loop == NULL)
 		exit(1);
 
-	zebra.fd = server_create(2601);
+	zebra.fd = server_create(ZEBRA_PORT);
 	if (zebra.fd == -1)
 		exit(1);
 
 	zebra.loop = loop;
 	zebra.source = event_loop_add_fd(loop, zebra.fd, 1, EVENT_READABLE, zebra_accept, &zebra);
 
+	/* the terminals do not depend on the machine mode, run without it */
+	machine.fd = server_create(MACHINE_PORT);
+	if (machine.fd < 0) {
+		fprintf(stderr, "machine mode on port %d disabled\n",
+			MACHINE_PORT);
+	} else {
+		machine.loop = loop;
+		machine.source = event_loop_add_fd(loop, machine.fd, 1,
+						   EVENT_READABLE,
+						   machine_accept, &machine);
+	}
+
 	term = term_create(loop, STDIN_FILENO, NULL);
 	if (term == NULL)
 		exit(1);
@@ -250,9 +406,19 @@ int main(int argc, char *argv[])
 				close(fd);
 				zebra.clients[i] = NULL;
 			}
+
+			if (machine.fd >= 0 && machine.clients[i] &&
+			    machine_want_exit(machine.clients[i])) {
+				int fd;
+				fd = machine_fd(machine.clients[i]);
+				machine_destroy(machine.clients[i]);
+				close(fd);
+				machine.clients[i] = NULL;
+			}
 		}
 	}
 
+	machine_server_destroy(&machine);
 	zebra_server_destroy(&zebra);
 	term_destroy(term);
 	event_loop_destroy(loop);
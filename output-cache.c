@@ -0,0 +1,186 @@
+/*
+ * Command Output Cache
+ *
+ * Copyright (c) 2021 Jiajia Liu <liujia6264@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include "output-cache.h"
+#include "hashtable.h"
+#include "stream.h"
+#include "list.h"
+
+struct output_key {
+	const char *key;
+	size_t len;
+};
+
+struct output_entry {
+	struct output_key key;
+	struct list_head lru;
+	uint64_t expires;	/* CLOCK_MONOTONIC ms */
+	size_t len;
+	char *data;
+	char buf[];		/* key then output */
+};
+
+static struct {
+	struct hashtable *table;
+	struct list_head lru;
+	struct output_cache_stats stats;
+} cache = {
+	.lru = LIST_HEAD_INIT(cache.lru),
+	.stats.capacity = OUTPUT_CACHE_SIZE,
+};
+
+static size_t output_key_hash(const void *data)
+{
+	const struct output_key *key = data;
+	size_t i, hash = 0;
+
+	for (i = 0; i < key->len; i++)
+		hash = hash * 31 + (unsigned char)key->key[i];
+
+	return hash;
+}
+
+static int output_key_compare(const void *a, const void *b)
+{
+	const struct output_key *k1 = a, *k2 = b;
+
+	if (k1->len != k2->len)
+		return 1;
+
+	return memcmp(k1->key, k2->key, k1->len);
+}
+
+static struct kpattr output_kpattr = {
+	.key_is_ptr = 1,
+	.value_is_ptr = 1,
+	.hash = output_key_hash,
+	.compare = output_key_compare,
+};
+
+static uint64_t output_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+static void output_cache_evict(struct output_entry *e)
+{
+	hashtable_delete(cache.table, &e->key);
+	list_del(&e->lru);
+	cache.stats.count--;
+	free(e);
+}
+
+/* Append the cached output for key to out. Returns 1 on a hit. */
+int output_cache_get(const void *key, size_t klen, struct stream *out)
+{
+	struct output_key k = { key, klen };
+	struct output_entry *e;
+
+	e = cache.table ? hashtable_get(cache.table, &k) : NULL;
+	if (e && e->expires <= output_now()) {
+		cache.stats.expired++;
+		output_cache_evict(e);
+		e = NULL;
+	}
+
+	if (e == NULL) {
+		cache.stats.misses++;
+		return 0;
+	}
+
+	cache.stats.hits++;
+	list_del(&e->lru);
+	list_add(&e->lru, &cache.lru);
+	stream_put(out, e->data, e->len);
+
+	return 1;
+}
+
+/* Cache what src holds past off as the output for key. */
+int output_cache_put(const void *key, size_t klen, struct stream *src,
+		     size_t off, unsigned int ttl_ms)
+{
+	struct output_key k = { key, klen };
+	struct output_entry *e;
+	size_t len = stream_ndata(src) - off;
+
+	if (len > OUTPUT_CACHE_MAXLEN)
+		return -EFBIG;
+
+	if (!cache.table) {
+		cache.table = hashtable_create(OUTPUT_CACHE_SIZE * 2, &output_kpattr);
+		if (!cache.table)
+			return -ENOMEM;
+	}
+
+	e = hashtable_get(cache.table, &k);
+	if (e)
+		output_cache_evict(e);
+
+	e = malloc(sizeof(*e) + klen + len);
+	if (!e)
+		return -ENOMEM;
+
+	memcpy(e->buf, key, klen);
+	e->key.key = e->buf;
+	e->key.len = klen;
+	e->data = e->buf + klen;
+	e->len = stream_peek(src, off, e->data, len);
+	e->expires = output_now() + ttl_ms;
+
+	if (cache.stats.count == cache.stats.capacity) {
+		cache.stats.evictions++;
+		output_cache_evict(list_last_entry(&cache.lru, struct output_entry, lru));
+	}
+
+	hashtable_set(cache.table, &e->key, e);
+	list_add(&e->lru, &cache.lru);
+	cache.stats.count++;
+
+	return 0;
+}
+
+void output_cache_stats(struct output_cache_stats *stats)
+{
+	*stats = cache.stats;
+}
+
+void output_cache_clear(void)
+{
+	struct output_entry *e, *next;
+
+	list_for_each_entry_safe(e, next, &cache.lru, lru)
+		output_cache_evict(e);
+}
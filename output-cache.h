@@ -0,0 +1,55 @@
+/*
+ * Command Output Cache
+ *
+ * Copyright (c) 2021 Jiajia Liu <liujia6264@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef _OUTPUT_CACHE_H_
+#define _OUTPUT_CACHE_H_
+
+#include <stddef.h>
+
+/*
+ * Process wide LRU cache of command outputs keyed by an opaque byte
+ * string, the command and its arguments. An entry is served until its
+ * ttl expires or the cache is cleared.
+ */
+#define OUTPUT_CACHE_SIZE	64
+#define OUTPUT_CACHE_MAXLEN	(64 * 1024)
+
+struct stream;
+
+struct output_cache_stats {
+	unsigned long hits;
+	unsigned long misses;
+	unsigned long expired;
+	unsigned long evictions;
+	unsigned int count;
+	unsigned int capacity;
+};
+
+int output_cache_get(const void *key, size_t klen, struct stream *out);
+int output_cache_put(const void *key, size_t klen, struct stream *src,
+		     size_t off, unsigned int ttl_ms);
+void output_cache_stats(struct output_cache_stats *stats);
+void output_cache_clear(void);
+
+#endif
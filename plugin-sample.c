@@ -0,0 +1,43 @@
+/*
+ * Sample Command Plugin
+ *
+ * Copyright (c) 2021 Jiajia Liu <liujia6264@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * Built as plugin-sample.so, loaded by "plugin load ./plugin-sample.so".
+ * The commands of a plugin are declared as usual, they land in the
+ * cmd_section of the shared object which CMD_PLUGIN() makes known.
+ */
+
+#include "cli-term.h"
+
+CMD_PLUGIN()
+
+COMMAND(sample_hello, NULL,
+	"sample hello NAME",
+	"Commands of the sample plugin\n"
+	"Say hello\n"
+	"Who to greet\n")
+{
+	term_print(term, "hello %s\r\n", opt->argv[0]);
+	return 0;
+}
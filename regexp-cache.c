@@ -0,0 +1,188 @@
+/*
+ * Compiled Regexp Cache
+ *
+ * Copyright (c) 2021 Jiajia Liu <liujia6264@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "regexp-cache.h"
+#include "hashtable.h"
+#include "libregexp.h"
+#include "list.h"
+
+struct regexp_key {
+	const char *pattern;
+	size_t len;
+	int flags;
+};
+
+struct regexp_entry {
+	struct regexp re;
+	struct regexp_key key;
+	struct list_head lru;
+	int refs;
+	char pattern[];
+};
+
+static struct {
+	struct hashtable *table;
+	struct list_head lru;
+	struct regexp_cache_stats stats;
+} cache = {
+	.lru = LIST_HEAD_INIT(cache.lru),
+	.stats.capacity = REGEXP_CACHE_SIZE,
+};
+
+static size_t regexp_key_hash(const void *data)
+{
+	const struct regexp_key *key = data;
+	size_t i, hash = key->flags;
+
+	for (i = 0; i < key->len; i++)
+		hash = hash * 31 + (unsigned char)key->pattern[i];
+
+	return hash;
+}
+
+static int regexp_key_compare(const void *a, const void *b)
+{
+	const struct regexp_key *k1 = a, *k2 = b;
+
+	if (k1->len != k2->len || k1->flags != k2->flags)
+		return 1;
+
+	return memcmp(k1->pattern, k2->pattern, k1->len);
+}
+
+static struct kpattr regexp_kpattr = {
+	.key_is_ptr = 1,
+	.value_is_ptr = 1,
+	.hash = regexp_key_hash,
+	.compare = regexp_key_compare,
+};
+
+int lre_check_stack_overflow(void *opaque, size_t alloca_size)
+{
+    return 0;
+}
+
+void *lre_realloc(void *opaque, void *ptr, size_t size)
+{
+    return realloc(ptr, size);
+}
+
+static void regexp_entry_unref(struct regexp_entry *e)
+{
+	if (--e->refs)
+		return;
+
+	free(e->re.bc);
+	free(e);
+}
+
+static void regexp_cache_evict(struct regexp_entry *e)
+{
+	hashtable_delete(cache.table, &e->key);
+	list_del(&e->lru);
+	cache.stats.count--;
+	regexp_entry_unref(e);
+}
+
+struct regexp *regexp_get(const char *pattern, size_t len, int flags,
+			  char *err, int errlen)
+{
+	struct regexp_key key = { pattern, len, flags };
+	struct regexp_entry *e;
+	int bclen;
+
+	if (!cache.table) {
+		cache.table = hashtable_create(REGEXP_CACHE_SIZE * 2, &regexp_kpattr);
+		if (!cache.table) {
+			snprintf(err, errlen, "out of memory");
+			return NULL;
+		}
+	}
+
+	e = hashtable_get(cache.table, &key);
+	if (e) {
+		cache.stats.hits++;
+		list_del(&e->lru);
+		list_add(&e->lru, &cache.lru);
+		e->refs++;
+		return &e->re;
+	}
+
+	cache.stats.misses++;
+
+	e = malloc(sizeof(*e) + len + 1);
+	if (!e) {
+		snprintf(err, errlen, "out of memory");
+		return NULL;
+	}
+
+	/* lre_compile() wants the pattern terminated */
+	memcpy(e->pattern, pattern, len);
+	e->pattern[len] = '\0';
+
+	e->re.bc = lre_compile(&bclen, err, errlen, e->pattern, len, flags, NULL);
+	if (!e->re.bc) {
+		free(e);
+		return NULL;
+	}
+
+	e->re.capture_count = lre_get_capture_count(e->re.bc);
+	e->key.pattern = e->pattern;
+	e->key.len = len;
+	e->key.flags = flags;
+	e->refs = 2;
+
+	if (cache.stats.count == cache.stats.capacity) {
+		cache.stats.evictions++;
+		regexp_cache_evict(list_last_entry(&cache.lru, struct regexp_entry, lru));
+	}
+
+	hashtable_set(cache.table, &e->key, e);
+	list_add(&e->lru, &cache.lru);
+	cache.stats.count++;
+
+	return &e->re;
+}
+
+void regexp_put(struct regexp *re)
+{
+	regexp_entry_unref((struct regexp_entry *)re);
+}
+
+void regexp_cache_stats(struct regexp_cache_stats *stats)
+{
+	*stats = cache.stats;
+}
+
+void regexp_cache_clear(void)
+{
+	struct regexp_entry *e, *next;
+
+	list_for_each_entry_safe(e, next, &cache.lru, lru)
+		regexp_cache_evict(e);
+}
@@ -0,0 +1,57 @@
+/*
+ * Compiled Regexp Cache
+ *
+ * Copyright (c) 2021 Jiajia Liu <liujia6264@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef _REGEXP_CACHE_H_
+#define _REGEXP_CACHE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Process wide LRU cache of lre bytecode keyed by pattern and flags.
+ * regexp_get() hands out a reference, an entry evicted while in use is
+ * freed by the last regexp_put().
+ */
+#define REGEXP_CACHE_SIZE	32
+
+struct regexp {
+	uint8_t *bc;
+	int capture_count;
+};
+
+struct regexp_cache_stats {
+	unsigned long hits;
+	unsigned long misses;
+	unsigned long evictions;
+	unsigned int count;
+	unsigned int capacity;
+};
+
+struct regexp *regexp_get(const char *pattern, size_t len, int flags,
+			  char *err, int errlen);
+void regexp_put(struct regexp *re);
+void regexp_cache_stats(struct regexp_cache_stats *stats);
+void regexp_cache_clear(void);
+
+#endif
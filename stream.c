@@ -29,11 +29,17 @@
 #include <string.h>
 #include <sys/uio.h>
 #include <unistd.h>
+#include <limits.h>
 
-#include "libregexp.h"
+#include "stream.h"
+#include "arena.h"
 
 #define BUFSIZE		4096
 
+#ifndef IOV_MAX
+#define IOV_MAX		1024
+#endif
+
 struct stream_node {
 	struct stream_node *next;
 	unsigned char data[BUFSIZE];
@@ -44,6 +50,8 @@ struct stream {
 	struct stream_node *first;
 	struct stream_node *last;
 	size_t count;
+
+	struct arena *arena;
 };
 
 int stream_put(struct stream *s, const void *data, size_t c)
@@ -142,16 +150,18 @@ int stream_vputs(struct stream *s, const char *fmt, va_list ap)
 
 	if (l >= sizeof(buf)) {
 		l++;
-		ptr = malloc(l);
-		if (ptr == NULL)
+		ptr = s->arena ? arena_alloc(s->arena, l) : malloc(l);
+		if (ptr == NULL) {
+			va_end(ap_copy);
 			return -ENOMEM;
+		}
 
 		l = vsnprintf(ptr, l, fmt, ap_copy);
 	}
 	va_end(ap_copy);
 
 	stream_putstrn(s, ptr, l);
-	if (ptr != buf)
+	if (ptr != buf && !s->arena)
 		free(ptr);
 
 	return l;
@@ -191,6 +201,12 @@ struct stream *stream_new(void)
 	return s;
 }
 
+/* large formatted strings are then staged in the arena instead of malloc */
+void stream_set_arena(struct stream *s, struct arena *arena)
+{
+	s->arena = arena;
+}
+
 void stream_free(struct stream *s)
 {
 	struct stream_node *ptr, *next;
@@ -224,7 +240,8 @@ void stream_consume(struct stream *s, size_t c)
 		ptr->tail += block;
 		c -= block;
 
-		if (ptr->tail == BUFSIZE) {
+		/* appended streams may leave partly filled nodes in the middle */
+		if (ptr->tail == ptr->head && (ptr->tail == BUFSIZE || next)) {
 			free(ptr);	
 			s->first = next;
 		}
@@ -239,6 +256,32 @@ size_t stream_ndata(struct stream *s)
 	return s->count;
 }
 
+/* Copy up to c bytes from offset off of s, leaving them in the stream. */
+size_t stream_peek(struct stream *s, size_t off, void *buf, size_t c)
+{
+	struct stream_node *ptr;
+	size_t block, done = 0;
+
+	for (ptr = s->first; ptr && c; ptr = ptr->next) {
+		block = ptr->head - ptr->tail;
+		if (off >= block) {
+			off -= block;
+			continue;
+		}
+
+		block -= off;
+		if (block > c)
+			block = c;
+
+		memcpy((char *)buf + done, ptr->data + ptr->tail + off, block);
+		off = 0;
+		done += block;
+		c -= block;
+	}
+
+	return done;
+}
+
 int stream_get(struct stream *s, void *buf, size_t c)
 {
 	int ret;
@@ -273,115 +316,190 @@ int stream_get(struct stream *s, void *buf, size_t c)
 	return ret;
 }
 
-int stream_iovec(struct stream *s, struct iovec **vec)
+/*
+ * Write as much as fd takes, IOV_MAX nodes per writev. Returns the bytes
+ * written, or -1 if nothing could be.
+ */
+int stream_flush(struct stream *s, int fd)
 {
-	struct iovec *iovec;
-	int idx = 0, count = 0;
+	struct iovec iovec[IOV_MAX];
 	struct stream_node *ptr;
+	ssize_t r, size, total = 0;
+	int count;
 
-	for (ptr = s->first; ptr; ptr = ptr->next)
-		count++;
-
-	if (!count)
-		return 0;
+	while (s->count) {
+		count = 0;
+		size = 0;
+		for (ptr = s->first; ptr && count < IOV_MAX; ptr = ptr->next) {
+			if (ptr->head == ptr->tail)
+				continue;
+			iovec[count].iov_base = ptr->data + ptr->tail;
+			iovec[count++].iov_len = ptr->head - ptr->tail;
+			size += ptr->head - ptr->tail;
+		}
 
-	iovec = malloc(sizeof(struct iovec) * count);
-	if (iovec == NULL)
-		return -ENOMEM;
+		r = writev(fd, iovec, count);
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+			return total ? total : -1;
+		}
 
-	*vec = iovec;
+		stream_consume(s, r);
+		total += r;
 
-	for (ptr = s->first; ptr; ptr = ptr->next) {
-		iovec[idx].iov_base = ptr->data + ptr->tail;
-		iovec[idx++].iov_len = ptr->head - ptr->tail;
+		/* a short write means fd is full */
+		if (r < size)
+			break;
 	}
 
-	return count;
+	return total;
 }
 
-int stream_flush(struct stream *s, int fd)
+/*
+ * Consume the stream and call fn on each non-empty line without its CR/LF.
+ * Lines are passed in place, only a line crossing a node boundary is
+ * gathered into a bounce buffer first. A negative return of fn stops the
+ * walk and the rest of the stream is dropped.
+ */
+int stream_for_each_line(struct stream *s, stream_line_fn fn, void *data)
 {
-	int count;
-	struct iovec *iovec;
+	struct stream_node *ptr;
+	char *carry = NULL;
+	size_t clen = 0, calloc_size = 0;
+	int ret = 0;
+
+	for (ptr = s->first; ptr && ret >= 0; ptr = ptr->next) {
+		char *p = (char *)ptr->data + ptr->tail;
+		char *end = (char *)ptr->data + ptr->head;
+
+		while (p < end && ret >= 0) {
+			char *nl = memchr(p, '\n', end - p);
+			char *cr = memchr(p, '\r', (nl ? nl : end) - p);
+			char *eol = cr ? cr : nl;
+			size_t len = (eol ? eol : end) - p;
+
+			if (clen || !eol) {
+				if (clen + len > calloc_size) {
+					size_t size = calloc_size ? calloc_size : 256;
+					char *tmp;
+
+					while (size < clen + len)
+						size *= 2;
+					tmp = realloc(carry, size);
+					if (tmp == NULL) {
+						ret = -ENOMEM;
+						break;
+					}
+					carry = tmp;
+					calloc_size = size;
+				}
+				memcpy(carry + clen, p, len);
+				clen += len;
+
+				if (eol) {
+					ret = fn(data, carry, clen);
+					clen = 0;
+				}
+			} else if (len) {
+				ret = fn(data, p, len);
+			}
 
-	count = stream_iovec(s, &iovec);
-	if (count <= 0)
-		return count;
+			p = eol ? eol + 1 : end;
+		}
+	}
 
-	count = writev(fd, iovec, count);
-	if (count > 0)
-		stream_consume(s, count);
-	free(iovec);
+	if (clen && ret >= 0)
+		ret = fn(data, carry, clen);
 
-	return count;
-}
+	free(carry);
+	stream_consume(s, s->count);
 
-#define CAPTURE_COUNT_MAX 255
-
-int lre_check_stack_overflow(void *opaque, size_t alloca_size)
-{
-    return 0;
+	return ret < 0 ? ret : 0;
 }
 
-void *lre_realloc(void *opaque, void *ptr, size_t size)
+/* move all data of src to the end of dst */
+void stream_append(struct stream *dst, struct stream *src)
 {
-    return realloc(ptr, size);
+	size_t n;
+
+	if (!src->first)
+		return;
+
+	/* a small stream is copied into the room left in the last node */
+	if (dst->last && src->count <= BUFSIZE - dst->last->head) {
+		n = stream_get(src, dst->last->data + dst->last->head, src->count);
+		dst->last->head += n;
+		dst->count += n;
+		return;
+	}
+
+	/* a drained node is only kept while it is the last one */
+	if (dst->count == 0) {
+		free(dst->first);
+		dst->first = dst->last = NULL;
+	}
+
+	if (dst->last)
+		dst->last->next = src->first;
+	else
+		dst->first = src->first;
+
+	dst->last = src->last;
+	dst->count += src->count;
+
+	src->first = src->last = NULL;
+	src->count = 0;
 }
 
-int stream_flush_regexp(struct stream *s, int fd, const char *regexp, size_t rlen)
+/*
+ * Length of the first *n complete lines of s. *n is lowered to the
+ * lines found when there are fewer.
+ */
+size_t stream_lines_len(struct stream *s, size_t *n)
 {
-	char line[8192];
-	char *ptr = line;
-	char c;
-	int len;
-	int ret;
-	char error_msg[64];
-    	uint8_t *capture[CAPTURE_COUNT_MAX * 2];
-	uint8_t *bc;
+	struct stream_node *ptr;
+	size_t off = 0, len = 0, found = 0;
 
-	bc = lre_compile(&len, error_msg, sizeof(error_msg), regexp, rlen, 0, NULL);
-	if (!bc) {
-		char buf[128];
+	for (ptr = s->first; ptr && found < *n; ptr = ptr->next) {
+		unsigned char *start = ptr->data + ptr->tail;
+		unsigned char *end = ptr->data + ptr->head;
+		unsigned char *p = start, *nl;
 
-		snprintf(buf, sizeof(buf), "lre_compile error: %s\n", error_msg);
-		write(fd, buf, strlen(buf));
+		while (found < *n && (nl = memchr(p, '\n', end - p))) {
+			found++;
+			p = nl + 1;
+			len = off + (p - start);
+		}
 
-		stream_consume(s, s->count);
-		return -1;
+		off += end - start;
 	}
 
-	while (stream_get(s, &c, 1) == 1) {
-		if (c == '\r' || c == '\n') {
-			if (ptr == line)
-				continue;
-			ret = lre_exec(capture, bc, (uint8_t *)line, 0, ptr - line, 0, NULL);
-			if (ret == 1) {
-				write(fd, line, ptr - line);
-				write(fd, "\r\n", 2);
-			} else if (ret == -1) {
-				char buf[128];
-				snprintf(buf, sizeof(buf), "lre_exec returns -1\n");
-				write(fd, buf, strlen(buf));
-			}
+	*n = found;
 
-			ptr = line;
-		} else {
-			*ptr++ = c;
-		}
-	}
+	return len;
+}
 
-	if (ptr > line) {
-		ret = lre_exec(capture, bc, (uint8_t *)line, 0, ptr - line, 0, NULL);
-		if (ret == 1) {
-			write(fd, line, ptr - line);
-		} else if (ret == -1) {
-			char buf[128];
-			snprintf(buf, sizeof(buf), "lre_exec returns -1\n");
-			write(fd, buf, strlen(buf));
-		}
-	}
+/* move the first len bytes of src to the end of dst */
+void stream_move(struct stream *dst, struct stream *src, size_t len)
+{
+	struct stream_node *ptr;
+	size_t block;
 
-	return 0;
+	if (len > src->count)
+		len = src->count;
+
+	while (len && (ptr = src->first)) {
+		block = ptr->head - ptr->tail;
+		if (block > len)
+			block = len;
+		if (block == 0)
+			break;
+
+		stream_put(dst, ptr->data + ptr->tail, block);
+		stream_consume(src, block);
+		len -= block;
+	}
 }
 
 #if 0
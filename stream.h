@@ -29,8 +29,11 @@
 #include <sys/types.h>
 #include <sys/uio.h>
 
+struct arena;
+
 extern struct stream *stream_new(void);
 extern void stream_free(struct stream *s);
+extern void stream_set_arena(struct stream *s, struct arena *arena);
 
 extern int stream_put(struct stream *s, const void *data, size_t c);
 extern int stream_putc(struct stream *s, int c);
@@ -41,8 +44,14 @@ extern void stream_dump(struct stream *s);
 extern void stream_consume(struct stream *s, size_t c);
 extern int stream_flush(struct stream *s, int fd);
 extern int stream_get(struct stream *s, void *buf, size_t c);
-extern int stream_iovec(struct stream *s, struct iovec **vec);
+extern size_t stream_peek(struct stream *s, size_t off, void *buf, size_t c);
 extern size_t stream_ndata(struct stream *s);
-extern int stream_flush_regexp(struct stream *s, int fd, const char *regexp, size_t rlen);
+
+typedef int (*stream_line_fn)(void *data, const char *line, size_t len);
+
+extern int stream_for_each_line(struct stream *s, stream_line_fn fn, void *data);
+extern void stream_append(struct stream *dst, struct stream *src);
+extern size_t stream_lines_len(struct stream *s, size_t *n);
+extern void stream_move(struct stream *dst, struct stream *src, size_t len);
 
 #endif
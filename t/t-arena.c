@@ -0,0 +1,79 @@
+#include <assert.h>
+#include <string.h>
+#include <stdint.h>
+
+#include <arena.h>
+#include "test-runner.h"
+
+TEST(t_arena_alloc) {
+	struct arena *a;
+	char *p, *q;
+
+	a = arena_create(64);
+	assert(a);
+
+	p = arena_alloc(a, 10);
+	q = arena_alloc(a, 10);
+	assert(p && q);
+	assert(((uintptr_t)p & 15) == 0);
+	assert(((uintptr_t)q & 15) == 0);
+	assert(q - p == 16);
+
+	p = arena_strndup(a, "hello, world", 5);
+	assert(strcmp(p, "hello") == 0);
+
+	p = arena_calloc(a, 100, 8);
+	assert(p);
+	for (q = p; q < p + 800; q++)
+		assert(*q == 0);
+
+	arena_destroy(a);
+}
+
+TEST(t_arena_reset) {
+	struct arena *a;
+	char *p, *q;
+	int i;
+
+	a = arena_create(64);
+	assert(a);
+
+	p = arena_alloc(a, 16);
+	arena_reset(a);
+	q = arena_alloc(a, 16);
+	assert(p == q);
+
+	/* outgrow the first chunk, the next round must fit in one chunk */
+	for (i = 0; i < 16; i++)
+		assert(arena_alloc(a, 32));
+	arena_reset(a);
+
+	p = arena_alloc(a, 32);
+	for (i = 1; i < 16; i++) {
+		q = arena_alloc(a, 32);
+		assert(q == p + i * 32);
+	}
+
+	arena_destroy(a);
+}
+
+TEST(t_arena_reset_shrink) {
+	struct arena *a;
+	char *p, *q;
+
+	a = arena_create(64);
+	assert(a);
+
+	/* a huge round is not kept, the next one starts at 64 bytes again */
+	assert(arena_alloc(a, 32));
+	assert(arena_alloc(a, 1024 * 1024));
+	arena_reset(a);
+
+	p = arena_alloc(a, 32);
+	q = arena_alloc(a, 32);
+	assert(q == p + 32);
+	q = arena_alloc(a, 32);
+	assert(q != p + 64);
+
+	arena_destroy(a);
+}
@@ -0,0 +1,839 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/ioctl.h>
+
+#include <cli-term.h>
+#include <stream.h>
+#include <event-loop.h>
+#include <output-cache.h>
+#include "test-runner.h"
+
+static int words_argc = -1;
+
+COMMAND(count_words, NULL, "words .WORDS", "words\nwords\n")
+{
+	words_argc = opt->argc;
+
+	return CMD_SUCCESS;
+}
+
+COMMAND(echo_words, NULL, "echo .WORDS", "echo\nwords\n")
+{
+	int i;
+
+	for (i = 0; i < opt->argc; i++)
+		term_print(term, "%s\r\n", opt->argv[i]);
+
+	return CMD_SUCCESS;
+}
+
+COMMAND(greet, NULL, "greet (hello|bye) NAME", "greet\nhello\nbye\nname\n")
+{
+	term_print(term, "%s %s\r\n", opt->argv[0], opt->argv[1]);
+
+	return CMD_SUCCESS;
+}
+
+COMMAND(pick_now, NULL, "pick all now", "pick\nall\nnow\n")
+{
+	term_print(term, "all now\r\n");
+
+	return CMD_SUCCESS;
+}
+
+COMMAND(pick_later, NULL, "pick WORD later", "pick\nword\nlater\n")
+{
+	term_print(term, "%s later\r\n", opt->argv[0]);
+
+	return CMD_SUCCESS;
+}
+
+static int cached_calls;
+
+COMMAND_CACHED(cached, NULL, 60000, "cached WORD", "cached\nword\n")
+{
+	term_print(term, "%s %d\r\n", opt->argv[0], ++cached_calls);
+
+	return CMD_SUCCESS;
+}
+
+COMMAND(fail, NULL, "fail", "fail\n")
+{
+	return CMD_WARNING;
+}
+
+struct slotopt {
+	const char *subcmd;
+	int number;
+	int eleven;
+};
+
+static struct slotopt slotopt, slots_seen;
+static char slots_subcmd[8];
+
+static void slotopt_init(void *buf, size_t size)
+{
+	struct slotopt *s = buf;
+
+	s->subcmd = NULL;
+	s->number = -1;
+	s->eleven = 0;
+}
+
+static int set_str(const char *src, void *dst)
+{
+	*(const char **)dst = src;
+	return 0;
+}
+
+static int set_int(const char *src, void *dst)
+{
+	*(int *)dst = strtol(src, NULL, 10);
+	return 0;
+}
+
+static int set_flag(const char *src, void *dst)
+{
+	*(int *)dst = 1;
+	return 0;
+}
+
+static struct optattr slot_attrs[] = {
+	{ .index = 0, .offset = offsetof(struct slotopt, subcmd), .set = set_str },
+	{ .index = -1, .key = "third", .offset = offsetof(struct slotopt, number), .set = set_int },
+	{ .index = -1, .key = "eleven", .offset = offsetof(struct slotopt, eleven), .set = set_flag },
+};
+
+static struct cmdoptattr slot_optattr = {
+	.attrs = slot_attrs,
+	.size = sizeof(slot_attrs) / sizeof(slot_attrs[0]),
+	.buf = &slotopt,
+	.bufsize = sizeof(slotopt),
+	.init = slotopt_init,
+};
+
+COMMAND(slots, &slot_optattr,
+	"slots (t1|t2) {first|second|third INT} stage {ten|eleven|twelve}",
+	"slots\nt1\nt2\nfirst\nsecond\nthird\nnumber\nstage\nten\neleven\ntwelve\n")
+{
+	/* the words only live as long as the command */
+	slots_seen = slotopt;
+	snprintf(slots_subcmd, sizeof(slots_subcmd), "%s", slotopt.subcmd);
+
+	return CMD_SUCCESS;
+}
+
+COMMAND(tab_alpha1, NULL, "tabx alpha1", "tabx\nalpha1\n")
+{
+	term_print(term, "alpha1\r\n");
+
+	return CMD_SUCCESS;
+}
+
+COMMAND(tab_alpha2, NULL, "tabx alpha2", "tabx\nalpha2\n")
+{
+	term_print(term, "alpha2\r\n");
+
+	return CMD_SUCCESS;
+}
+
+COMMAND(tab_go, NULL, "tabx go", "tabx\ngo\n")
+{
+	term_print(term, "go\r\n");
+
+	return CMD_SUCCESS;
+}
+
+COMMAND(tab_gone, NULL, "tabx gone", "tabx\ngone\n")
+{
+	term_print(term, "gone\r\n");
+
+	return CMD_SUCCESS;
+}
+
+#define PAGE_LINES	100
+
+static int page_calls, page_released;
+
+static int page_more(struct term *term, void *data)
+{
+	int *next = data;
+
+	page_calls++;
+	term_print(term, "line %d\r\n", (*next)++);
+
+	return *next < PAGE_LINES;
+}
+
+static void page_release(void *data)
+{
+	page_released++;
+	free(data);
+}
+
+COMMAND(pages, NULL, "pages", "pages\n")
+{
+	int *next = calloc(1, sizeof(int));
+
+	if (next == NULL)
+		return CMD_ERR_SYSTEM;
+
+	return term_more(term, page_more, next, page_release) ? CMD_ERR_SYSTEM : CMD_SUCCESS;
+}
+
+/* a terminal on one end of a socketpair, the test talks on the other */
+static struct term *term_open(struct event_loop *loop, int sv[2])
+{
+	struct term *term;
+
+	assert(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+	fcntl(sv[1], F_SETFL, O_NONBLOCK);
+	term = term_create(loop, sv[0], "t");
+	assert(term);
+
+	return term;
+}
+
+static void term_close(struct term *term, int sv[2])
+{
+	term_destroy(term);
+	close(sv[0]);
+	close(sv[1]);
+}
+
+/* send keys to the terminal, run the loop and collect what it writes */
+static void term_keys(struct event_loop *loop, int sv[2], const char *keys,
+		      char *buf, size_t size)
+{
+	size_t len = 0;
+	char drop[256];
+	ssize_t n;
+	int i, queued;
+
+	assert(write(sv[1], keys, strlen(keys)) == strlen(keys));
+
+	/*
+	 * The terminal takes a key per round. Read as it goes, unread
+	 * output would stop the socket from polling writable.
+	 */
+	for (i = 0; i < 64; i++) {
+		event_loop_dispatch(loop, 0);
+		while ((n = read(sv[1], drop, sizeof(drop))) > 0) {
+			if (n > size - 1 - len)
+				n = size - 1 - len;
+			memcpy(buf + len, drop, n);
+			len += n;
+		}
+		if (ioctl(sv[0], FIONREAD, &queued) == 0 && queued > 0)
+			i = 0;
+	}
+	buf[len] = '\0';
+}
+
+TEST(t_cmd_tree_shared) {
+	struct event_loop *loop = event_loop_create();
+	struct cmd_tree *tree = cmd_tree_get_default();
+	struct term *a, *b;
+	int sa[2], sb[2], refs;
+	char buf[1024];
+
+	assert(loop && tree);
+	refs = cmd_tree_refcnt(tree);
+
+	/* every terminal holds a reference on the one default tree */
+	a = term_open(loop, sa);
+	b = term_open(loop, sb);
+	assert(term_cmd_tree(a) == tree && term_cmd_tree(b) == tree);
+	assert(cmd_tree_refcnt(tree) == refs + 2);
+
+	/* and the tree outlives the terminals that go away */
+	term_close(a, sa);
+	assert(cmd_tree_refcnt(tree) == refs + 1);
+	words_argc = -1;
+	term_keys(loop, sb, "words x\r", buf, sizeof(buf));
+	assert(words_argc == 1);
+	term_close(b, sb);
+	assert(cmd_tree_refcnt(tree) == refs);
+
+	cmd_tree_put(tree);
+	event_loop_destroy(loop);
+}
+
+TEST(t_cmd_line_limits) {
+	struct event_loop *loop = event_loop_create();
+	struct term *term;
+	char line[MAXARGC * 2 + 16], buf[1024];
+	int sv[2], i, l;
+
+	assert(loop);
+	term = term_open(loop, sv);
+
+	/* one word more than MAXARGC is refused, not cut */
+	l = snprintf(line, sizeof(line), "words");
+	for (i = 1; i <= MAXARGC; i++)
+		l += snprintf(line + l, sizeof(line) - l, " x");
+	line[l++] = '\r';
+	line[l] = '\0';
+	words_argc = -1;
+	term_keys(loop, sv, line, buf, sizeof(buf));
+	assert(words_argc == -1);
+
+	/* MAXARGC words fit */
+	strcpy(line + l - 3, "\r");
+	term_keys(loop, sv, line, buf, sizeof(buf));
+	assert(words_argc == MAXARGC - 1);
+
+	term_close(term, sv);
+	event_loop_destroy(loop);
+}
+
+TEST(t_cmd_keyword_slots) {
+	struct event_loop *loop = event_loop_create();
+	struct term *term;
+	char buf[1024];
+	int sv[2];
+
+	assert(loop);
+	term = term_open(loop, sv);
+
+	/* keyword values land in the fields their attrs are bound to */
+	term_keys(loop, sv, "slots t2 third 7 stage eleven\r", buf, sizeof(buf));
+	assert(strcmp(slots_subcmd, "t2") == 0);
+	assert(slots_seen.number == 7 && slots_seen.eleven == 1);
+
+	/* and keep their defaults when not given */
+	term_keys(loop, sv, "slots t1 first stage ten\r", buf, sizeof(buf));
+	assert(strcmp(slots_subcmd, "t1") == 0);
+	assert(slots_seen.number == -1 && slots_seen.eleven == 0);
+
+	term_close(term, sv);
+	event_loop_destroy(loop);
+}
+
+TEST(t_term_pager) {
+	struct event_loop *loop = event_loop_create();
+	struct term *term;
+	char buf[8192];
+	int sv[2], calls;
+
+	assert(loop);
+	term = term_open(loop, sv);
+
+	/* a filter needs the whole output, the pager is drained */
+	page_calls = page_released = 0;
+	term_keys(loop, sv, "pages | count\r", buf, sizeof(buf));
+	assert(strstr(buf, "\r\n100\r\n") != NULL);
+	assert(page_calls == PAGE_LINES && page_released == 1);
+
+	/* only what a page takes is generated */
+	term_set_length(term, 5);
+	page_calls = page_released = 0;
+	term_keys(loop, sv, "pages\r", buf, sizeof(buf));
+	assert(strstr(buf, "line 3\r\n") && !strstr(buf, "line 4\r\n"));
+	assert(strstr(buf, "--More--") != NULL);
+	assert(page_calls < 10 && page_released == 0);
+
+	term_keys(loop, sv, "\r", buf, sizeof(buf));
+	assert(strstr(buf, "line 4\r\n") && !strstr(buf, "line 5\r\n"));
+
+	/* q ends the output without generating the rest */
+	calls = page_calls;
+	term_keys(loop, sv, "q", buf, sizeof(buf));
+	assert(page_released == 1 && page_calls == calls);
+	assert(strstr(buf, "line") == NULL);
+
+	/* the terminal takes commands again */
+	words_argc = -1;
+	term_keys(loop, sv, "words x y\r", buf, sizeof(buf));
+	assert(words_argc == 2);
+
+	term_close(term, sv);
+	event_loop_destroy(loop);
+}
+
+TEST(t_cmd_complete_lcp) {
+	struct cmd_tree *tree = cmd_tree_get_default();
+	const char *const *keys;
+	int n, lcp;
+
+	/* the keys share "alpha", which is what TAB inserts */
+	assert(cmd_complete(tree, "tabx al", &n, &keys, &lcp) == CMD_COMPLETE_MATCH);
+	assert(n == 2 && lcp == 5);
+	assert(strncmp(keys[0], "alpha", lcp) == 0);
+
+	assert(cmd_complete(tree, "tabx alpha2", &n, &keys, &lcp) == CMD_COMPLETE_FULL_MATCH);
+	assert(n == 1 && strcmp(keys[0], "alpha2") == 0);
+
+	/* nothing in common to insert, the keys are listed */
+	assert(cmd_complete(tree, "tabx ", &n, &keys, &lcp) == CMD_COMPLETE_LIST_MATCH);
+	assert(n == 4);
+
+	assert(cmd_complete(tree, "tabx z", &n, &keys, &lcp) == CMD_ERR_NO_MATCH);
+
+	cmd_tree_put(tree);
+}
+
+TEST(t_cmd_abbrev) {
+	struct event_loop *loop = event_loop_create();
+	struct term *term;
+	char buf[1024];
+	int sv[2];
+
+	assert(loop);
+	term = term_open(loop, sv);
+
+	/* a unique prefix stands for its literal */
+	term_keys(loop, sv, "tab alpha1\r", buf, sizeof(buf));
+	assert(strstr(buf, "\r\nalpha1\r\n") != NULL);
+	term_keys(loop, sv, "tabx gon\r", buf, sizeof(buf));
+	assert(strstr(buf, "\r\ngone\r\n") != NULL);
+
+	/* an exact literal wins over the longer one it is a prefix of */
+	term_keys(loop, sv, "tabx go\r", buf, sizeof(buf));
+	assert(strstr(buf, "\r\ngo\r\n") != NULL);
+
+	term_keys(loop, sv, "tabx al\r", buf, sizeof(buf));
+	assert(strstr(buf, "Ambiguous command") != NULL);
+	term_keys(loop, sv, "tabx alpha\r", buf, sizeof(buf));
+	assert(strstr(buf, "Ambiguous command") != NULL);
+
+	term_close(term, sv);
+	event_loop_destroy(loop);
+}
+
+/* what a command runs with, its output is read back into buf */
+struct fixture {
+	struct cmd_tree *tree;
+	struct cmdopt *opt;
+	struct stream *out;
+	char buf[2048];
+};
+
+static void fixture_init(struct fixture *f, struct cmd_tree *tree)
+{
+	f->tree = tree ? tree : cmd_tree_get_default();
+	f->opt = cmdopt_create();
+	f->out = stream_new();
+	assert(f->tree && f->opt && f->out);
+}
+
+static void fixture_fini(struct fixture *f)
+{
+	stream_free(f->out);
+	cmdopt_destroy(f->opt);
+	cmd_tree_put(f->tree);
+}
+
+static const char *drain(struct fixture *f)
+{
+	f->buf[stream_get(f->out, f->buf, sizeof(f->buf) - 1)] = '\0';
+
+	return f->buf;
+}
+
+static int exec(struct fixture *f, const char *line)
+{
+	int ret;
+
+	ret = cmd_exec_buf(f->tree, line, f->out, f->opt);
+	drain(f);
+
+	return ret;
+}
+TEST(t_cmd_exec_buf) {
+	struct fixture f;
+
+	fixture_init(&f, NULL);
+
+	assert(exec(&f, "echo a b") == CMD_SUCCESS);
+	assert(strcmp(f.buf, "a\r\nb\r\n") == 0);
+
+	assert(exec(&f, "ec c") == CMD_SUCCESS);
+	assert(strcmp(f.buf, "c\r\n") == 0);
+
+	assert(exec(&f, "nosuch") == CMD_ERR_NO_MATCH);
+	assert(strstr(f.buf, "Unknown command") != NULL);
+
+	assert(exec(&f, "greet") == CMD_ERR_INCOMPLETE);
+	assert(exec(&f, "gr b x") == CMD_SUCCESS);
+	assert(strcmp(f.buf, "bye x\r\n") == 0);
+
+	/* filters see the output of the command only */
+	stream_puts(f.out, "kept\r\n");
+	assert(cmd_exec_buf(f.tree, "echo x y | exclude x", f.out, f.opt) == CMD_SUCCESS);
+	drain(&f);
+	assert(strcmp(f.buf, "kept\r\ny\r\n") == 0);
+
+	assert(exec(&f, "echo x | wc -l") == CMD_ERR_SYSTEM);
+
+	fixture_fini(&f);
+}
+
+extern const struct cmd_elem __start_cmd_section, __stop_cmd_section;
+
+TEST(t_cmd_stats) {
+	struct fixture f;
+	unsigned long calls, errors;
+	char *p;
+
+	fixture_init(&f, cmd_tree_build(&__start_cmd_section, &__stop_cmd_section));
+
+	assert(exec(&f, "echo a") == CMD_SUCCESS);
+	assert(exec(&f, "echo b c") == CMD_SUCCESS);
+	assert(exec(&f, "fail") == CMD_WARNING);
+
+	cmd_stats_show(f.tree, f.out);
+	p = strstr(drain(&f), "  echo .WORDS\r\n");
+	assert(p);
+	while (p > f.buf && p[-1] != '\n')
+		p--;
+	assert(sscanf(p, "%lu %lu", &calls, &errors) == 2);
+	assert(calls == 2 && errors == 0);
+
+	p = strstr(f.buf, "  fail\r\n");
+	assert(p);
+	while (p > f.buf && p[-1] != '\n')
+		p--;
+	assert(sscanf(p, "%lu %lu", &calls, &errors) == 2);
+	assert(calls == 1 && errors == 1);
+
+	cmd_stats_reset(f.tree);
+	cmd_stats_show(f.tree, f.out);
+	assert(strstr(drain(&f), "echo") == NULL);
+
+	fixture_fini(&f);
+}
+
+TEST(t_cmd_exec_cached) {
+	struct fixture f;
+
+	fixture_init(&f, NULL);
+
+	assert(exec(&f, "cached a") == CMD_SUCCESS);
+	assert(strcmp(f.buf, "a 1\r\n") == 0);
+	assert(exec(&f, "ca a") == CMD_SUCCESS);
+	assert(strcmp(f.buf, "a 1\r\n") == 0);
+	assert(exec(&f, "cached b") == CMD_SUCCESS);
+	assert(strcmp(f.buf, "b 2\r\n") == 0);
+
+	output_cache_clear();
+	assert(exec(&f, "cached a") == CMD_SUCCESS);
+	assert(strcmp(f.buf, "a 3\r\n") == 0);
+
+	fixture_fini(&f);
+}
+
+static void corrupt(const char *path, long off, size_t len)
+{
+	FILE *fp = fopen(path, "r+");
+
+	assert(fp && fseek(fp, off, SEEK_SET) == 0);
+	while (len--)
+		fputc(0xff, fp);
+	fclose(fp);
+}
+
+TEST(t_cmd_tree_image) {
+	const struct cmd_elem *start = &__start_cmd_section;
+	const struct cmd_elem *end = &__stop_cmd_section;
+	struct cmd_tree *tree = cmd_tree_build(start, end);
+	struct fixture f;
+	const char *const *keys;
+	char path[64], src[80], buf[256];
+	struct stat st;
+	FILE *fp;
+	int n, lcp;
+
+	snprintf(path, sizeof(path), "/tmp/t-cmd-tree.%d", getpid());
+	assert(cmd_tree_save(tree, path) == 0);
+	assert(stat(path, &st) == 0);
+
+	/* the generated source holds the same image */
+	snprintf(src, sizeof(src), "%s.c", path);
+	assert(cmd_tree_emit(tree, src) == 0);
+	fp = fopen(src, "r");
+	assert(fp && fseek(fp, -64, SEEK_END) == 0);
+	buf[fread(buf, 1, 64, fp)] = '\0';
+	fclose(fp);
+	unlink(src);
+	snprintf(src, sizeof(src), "cmd_tree_embedded_size = %ld;\n", (long)st.st_size);
+	assert(strstr(buf, src) != NULL);
+	cmd_tree_put(tree);
+
+	/* other elems than the image was built from */
+	assert(cmd_tree_load(path, start, end - 1) == NULL);
+
+	fixture_init(&f, cmd_tree_load(path, start, end));
+
+	assert(exec(&f, "gr h x") == CMD_SUCCESS);
+	assert(strcmp(f.buf, "hello x\r\n") == 0);
+	assert(exec(&f, "greet") == CMD_ERR_INCOMPLETE);
+
+	assert(cmd_complete(f.tree, "gre", &n, &keys, &lcp) == CMD_COMPLETE_FULL_MATCH);
+	assert(strcmp(keys[0], "greet") == 0);
+	fixture_fini(&f);
+
+	/* the strtab at the end is no longer terminated */
+	corrupt(path, st.st_size - 8, 8);
+	assert(cmd_tree_load(path, start, end) == NULL);
+
+	/* every index in the arrays after the 88 bytes header is out of range */
+	corrupt(path, 88, st.st_size - 88);
+	assert(cmd_tree_load(path, start, end) == NULL);
+	unlink(path);
+}
+
+static int extra(struct term *term, struct cmdopt *opt)
+{
+	term_print(term, "extra %s\r\n", opt->argv[0]);
+
+	return CMD_SUCCESS;
+}
+
+static struct cmd_elem extra_elems[] = {
+	{ "extra WORD", "extra\nword\n", extra, NULL, 0 },
+};
+
+static struct cmd_elem bad_elems[] = {
+	{ "badbound INT<5-1>", "badbound\nnumber\n", extra, NULL, 0 },
+};
+
+TEST(t_cmd_register) {
+	struct cmd_tree *old;
+	struct fixture f;
+
+	fixture_init(&f, NULL);
+
+	assert(exec(&f, "extra a") == CMD_ERR_NO_MATCH);
+
+	assert(cmd_register("extra", extra_elems, extra_elems + 1) == 0);
+	assert(cmd_register("extra", extra_elems, extra_elems + 1) == -EEXIST);
+	assert(cmd_tree_reload() == 0);
+
+	/* a session keeps its tree until it moves between commands */
+	old = cmd_tree_get(f.tree);
+	assert(exec(&f, "extra a") == CMD_ERR_NO_MATCH);
+	assert(cmd_tree_update(&f.tree) != old);
+	assert(exec(&f, "extra a") == CMD_SUCCESS);
+	assert(strcmp(f.buf, "extra a\r\n") == 0);
+	assert(exec(&f, "list | include extra") == CMD_SUCCESS);
+	assert(strcmp(f.buf, "  extra WORD\r\n") == 0);
+	assert(cmd_exec_buf(old, "echo b", f.out, f.opt) == CMD_SUCCESS);
+	drain(&f);
+	cmd_tree_put(old);
+
+	/* a bad bound rejects the command, it does not take any word */
+	assert(cmd_register("bad", bad_elems, bad_elems + 1) == 0);
+	assert(cmd_tree_reload() == 0);
+	cmd_tree_update(&f.tree);
+	assert(exec(&f, "badbound x") != CMD_SUCCESS);
+	assert(exec(&f, "badbound 3") != CMD_SUCCESS);
+	assert(strstr(f.buf, "extra") == NULL);
+	assert(cmd_unregister("bad") == 0);
+
+	assert(cmd_unregister("extra") == 0);
+	assert(cmd_unregister("extra") == -ENOENT);
+	assert(cmd_tree_reload() == 0);
+	cmd_tree_update(&f.tree);
+	assert(exec(&f, "extra a") == CMD_ERR_NO_MATCH);
+
+	fixture_fini(&f);
+}
+
+TEST(t_cmd_tree_lazy) {
+	struct fixture f;
+	const char *const *keys;
+	int n, lcp;
+
+	fixture_init(&f, cmd_tree_build(&__start_cmd_section, &__stop_cmd_section));
+
+	/* the first words are known before any group is parsed */
+	assert(cmd_complete(f.tree, "gr", &n, &keys, &lcp) == CMD_COMPLETE_FULL_MATCH);
+	assert(cmd_complete(f.tree, "gr h", &n, &keys, &lcp) == CMD_COMPLETE_FULL_MATCH);
+	assert(strcmp(keys[0], "hello") == 0);
+	assert(exec(&f, "cached") == CMD_ERR_INCOMPLETE);
+
+	cmd_tree_travel(f.tree, f.out);
+	assert(strstr(drain(&f), "groups parsed on demand\r\nparse time") != NULL);
+
+	fixture_fini(&f);
+}
+
+TEST(t_cmd_search) {
+	struct fixture f;
+
+	fixture_init(&f, cmd_tree_build(&__start_cmd_section, &__stop_cmd_section));
+
+	assert(exec(&f, "pick all now") == 0);
+	assert(strcmp(f.buf, "all now\r\n") == 0);
+
+	/* the literal matches first but only the variable leads on */
+	assert(exec(&f, "pick all later") == 0);
+	assert(strcmp(f.buf, "all later\r\n") == 0);
+
+	assert(exec(&f, "pick all") == CMD_ERR_INCOMPLETE);
+	assert(exec(&f, "pick x now") == CMD_ERR_NO_MATCH);
+
+	fixture_fini(&f);
+}
+
+TEST(t_cmd_watch_pipe) {
+	struct fixture f;
+
+	fixture_init(&f, NULL);
+
+	/* the pipe would filter what watch prints, not the watched command */
+	assert(exec(&f, "watch echo a | include a") == CMD_WARNING);
+	assert(strstr(f.buf, "pipe not supported") != NULL);
+
+	assert(exec(&f, "watch -n 1 echo a") == CMD_WARNING);
+	assert(strstr(f.buf, "Cannot watch") != NULL);
+	assert(strstr(f.buf, "pipe") == NULL);
+
+	fixture_fini(&f);
+}
+
+#define WIDE	100
+
+static char wide_lines[WIDE][32];
+static struct cmd_elem wide_elems[WIDE];
+
+/* every variable takes the word, so it is followed on WIDE paths at once */
+TEST(t_cmd_search_wide) {
+	struct fixture f;
+	char line[32];
+	int i;
+
+	for (i = 0; i < WIDE; i++) {
+		snprintf(wide_lines[i], sizeof(wide_lines[i]), "wide W%d end%d", i, i);
+		wide_elems[i].line = wide_lines[i];
+		wide_elems[i].desc = "wide\nword\nend\n";
+		wide_elems[i].func = extra;
+	}
+	fixture_init(&f, cmd_tree_build(wide_elems, wide_elems + WIDE));
+
+	assert(exec(&f, "wide x end0") == CMD_SUCCESS);
+	assert(strcmp(f.buf, "extra x\r\n") == 0);
+	snprintf(line, sizeof(line), "wide y end%d", WIDE - 1);
+	assert(exec(&f, line) == CMD_SUCCESS);
+	assert(strcmp(f.buf, "extra y\r\n") == 0);
+
+	fixture_fini(&f);
+}
+
+static int twin(struct term *term, struct cmdopt *opt)
+{
+	term_print(term, "twin %s\r\n", opt->argv[0]);
+
+	return CMD_SUCCESS;
+}
+
+static int twin_int(struct term *term, struct cmdopt *opt)
+{
+	term_print(term, "int %s\r\n", opt->argv[0]);
+
+	return CMD_SUCCESS;
+}
+
+static int twin_all(struct term *term, struct cmdopt *opt)
+{
+	term_print(term, "all\r\n");
+
+	return CMD_SUCCESS;
+}
+
+static struct cmd_elem twin_elems[] = {
+	{ "twin INT", "twin\nnumber\n", twin_int, NULL, 0 },
+	{ "twin WORD", "twin\nword\n", twin, NULL, 0 },
+	{ "twin all", "twin\nall\n", twin_all, NULL, 0 },
+	{ "pair a WORD", "pair\na\nword\n", twin, NULL, 0 },
+	{ "pair WORD b", "pair\nword\nb\n", twin_int, NULL, 0 },
+};
+
+/* complete commands of the same rank are not told apart by their order */
+TEST(t_cmd_search_ambiguous) {
+	struct fixture f;
+
+	fixture_init(&f, cmd_tree_build(twin_elems, twin_elems + 5));
+
+	assert(exec(&f, "twin 5") == CMD_ERR_AMBIGUOUS);
+	assert(strstr(f.buf, "Ambiguous command") != NULL);
+
+	/* a literal outranks the variables, only WORD takes x */
+	assert(exec(&f, "twin all") == CMD_SUCCESS);
+	assert(strcmp(f.buf, "all\r\n") == 0);
+	assert(exec(&f, "twin x") == CMD_SUCCESS);
+	assert(strcmp(f.buf, "twin x\r\n") == 0);
+
+	/* the first word where the paths differ decides */
+	assert(exec(&f, "pair a b") == CMD_SUCCESS);
+	assert(strcmp(f.buf, "twin b\r\n") == 0);
+
+	fixture_fini(&f);
+}
+
+static void write_file(const char *path, const char *data, size_t len)
+{
+	FILE *fp = fopen(path, "w");
+
+	assert(fp && fwrite(data, 1, len, fp) == len);
+	fclose(fp);
+}
+
+TEST(t_cmd_source) {
+	struct fixture f;
+	struct cmd_source_stats st;
+	static const char script[] = "# comment\necho a\nnosuch\necho b\n";
+	char path[64], line[96], *big;
+	int n;
+
+	fixture_init(&f, NULL);
+
+	snprintf(path, sizeof(path), "/tmp/t-cmd-source.%d", getpid());
+	write_file(path, script, strlen(script));
+
+	/* the first failure stops the script */
+	assert(cmd_source(f.tree, path, 0, f.out, -1, &st) == CMD_ERR_NO_MATCH);
+	assert(st.lines == 3 && st.commands == 2 && st.failed == 1);
+	drain(&f);
+	assert(strstr(f.buf, "a\r\n") && !strstr(f.buf, "b\r\n"));
+	assert(strstr(f.buf, ":3: failed") != NULL);
+
+	assert(cmd_source(f.tree, path, CMD_SOURCE_CONTINUE, f.out, -1, &st) == CMD_ERR_NO_MATCH);
+	assert(st.lines == 4 && st.commands == 3 && st.failed == 1);
+	drain(&f);
+	assert(strstr(f.buf, "a\r\n") && strstr(f.buf, "b\r\n"));
+
+	/* the same through the source command */
+	snprintf(line, sizeof(line), "source %s", path);
+	assert(exec(&f, line) == CMD_WARNING);
+	assert(strstr(f.buf, "2 commands, 1 failed") != NULL);
+	snprintf(line, sizeof(line), "source %s continue", path);
+	assert(exec(&f, line) == CMD_WARNING);
+	assert(strstr(f.buf, "3 commands, 1 failed") != NULL);
+
+	/* a last line without newline is refused, not cut, when too long */
+	n = CMD_LINE_MAX + 16;
+	big = malloc(n);
+	assert(big);
+	memcpy(big, "echo a\necho ", 12);
+	memset(big + 12, 'x', n - 12);
+	write_file(path, big, n);
+	free(big);
+	assert(cmd_source(f.tree, path, 0, f.out, -1, &st) == CMD_ERR_EXEED_ARGC_MAX);
+	assert(st.commands == 2 && st.failed == 1);
+	drain(&f);
+	assert(strstr(f.buf, "Command too long") != NULL);
+	assert(strchr(f.buf, 'x') == NULL);
+	unlink(path);
+
+	fixture_fini(&f);
+}
@@ -0,0 +1,97 @@
+#include <assert.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+
+#include <arena.h>
+#include <stream.h>
+#include <filter.h>
+#include "test-runner.h"
+
+static const char *input =
+	"eth0 up\r\n"
+	"eth1 down\r\n"
+	"lo up\r\n"
+	"eth2 up\r\n"
+	"wlan0 down\r\n";
+
+static void run(const char *spec, const char *expect)
+{
+	struct arena *a = arena_create(256);
+	struct stream *s = stream_new();
+	struct filter_chain *chain;
+	const char *rest;
+	char err[64], buf[256];
+	int n;
+
+	stream_put(s, input, strlen(input));
+	assert(filter_chain_parse(a, spec, &chain, &rest, err, sizeof(err)) == 0);
+	assert(rest == NULL);
+	assert(filter_chain_run(chain, s) == 0);
+	filter_chain_free(chain);
+
+	n = stream_get(s, buf, sizeof(buf) - 1);
+	buf[n] = '\0';
+	assert(strcmp(buf, expect) == 0);
+
+	stream_free(s);
+	arena_destroy(a);
+}
+
+TEST(t_filter_chain) {
+	run("| include up", "eth0 up\r\nlo up\r\neth2 up\r\n");
+	run("| exclude up|lo", "eth1 down\r\nwlan0 down\r\n");
+	run("| begin lo | count", "3\r\n");
+	run("| sort | head 2", "eth0 up\r\neth1 down\r\n");
+	run("| tail 2", "eth2 up\r\nwlan0 down\r\n");
+	run("| head 3 | tail 1 | count", "1\r\n");
+}
+
+TEST(t_filter_parse) {
+	struct arena *a = arena_create(256);
+	struct filter_chain *chain;
+	const char *rest;
+	char err[64];
+
+	assert(filter_chain_parse(a, "| grep x", &chain, &rest, err, sizeof(err)) == -ENOENT);
+	assert(filter_chain_parse(a, "| include", &chain, &rest, err, sizeof(err)) == -EINVAL);
+	assert(filter_chain_parse(a, "| head -3", &chain, &rest, err, sizeof(err)) == -ENOENT);
+	assert(filter_chain_parse(a, "| sort -n", &chain, &rest, err, sizeof(err)) == -ENOENT);
+	assert(filter_chain_parse(a, "| include (", &chain, &rest, err, sizeof(err)) == -EINVAL);
+	assert(filter_chain_parse(a, "| tail 100001", &chain, &rest, err, sizeof(err)) == -EINVAL);
+	assert(filter_chain_parse(a, "| tail 1152921504606846976", &chain, &rest,
+				  err, sizeof(err)) == -EINVAL);
+	assert(filter_chain_parse(a, "| head 99999999999999999999", &chain, &rest,
+				  err, sizeof(err)) == -EINVAL);
+
+	arena_destroy(a);
+}
+
+/* the leading built-in stages run in process, the shell only gets the rest */
+TEST(t_filter_mixed) {
+	struct arena *a = arena_create(256);
+	struct stream *s = stream_new();
+	struct filter_chain *chain;
+	const char *spec = "| include up | exclude lo | grep eth | include x";
+	const char *rest;
+	char err[64], buf[256];
+	int n;
+
+	stream_put(s, input, strlen(input));
+	assert(filter_chain_parse(a, spec, &chain, &rest, err, sizeof(err)) == 0);
+	assert(rest && strcmp(rest, "| grep eth | include x") == 0);
+	assert(filter_chain_run(chain, s) == 0);
+	filter_chain_free(chain);
+
+	n = stream_get(s, buf, sizeof(buf) - 1);
+	buf[n] = '\0';
+	assert(strcmp(buf, "eth0 up\r\neth2 up\r\n") == 0);
+
+	assert(filter_chain_parse(a, "| count | head -3", &chain, &rest,
+				  err, sizeof(err)) == 0);
+	assert(rest && strcmp(rest, "| head -3") == 0);
+	filter_chain_free(chain);
+
+	stream_free(s);
+	arena_destroy(a);
+}
@@ -0,0 +1,56 @@
+#include <assert.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include <stream.h>
+#include <output-cache.h>
+#include "test-runner.h"
+
+static int get(const char *key, char *buf, size_t size)
+{
+	struct stream *s = stream_new();
+	int hit, n;
+
+	hit = output_cache_get(key, strlen(key), s);
+	n = stream_get(s, buf, size - 1);
+	buf[n] = '\0';
+	stream_free(s);
+
+	return hit;
+}
+
+TEST(t_output_cache) {
+	struct output_cache_stats st;
+	struct stream *s = stream_new();
+	char buf[64];
+
+	output_cache_clear();
+
+	assert(get("show x", buf, sizeof(buf)) == 0);
+
+	/* only the output past the offset is kept */
+	stream_puts(s, "prompt> ");
+	stream_puts(s, "line 1\r\nline 2\r\n");
+	assert(output_cache_put("show x", 6, s, 8, 1000) == 0);
+	assert(stream_ndata(s) == 24);
+
+	assert(get("show x", buf, sizeof(buf)) == 1);
+	assert(strcmp(buf, "line 1\r\nline 2\r\n") == 0);
+	assert(get("show y", buf, sizeof(buf)) == 0);
+
+	assert(output_cache_put("show y", 6, s, 0, 1) == 0);
+	usleep(5000);
+	assert(get("show y", buf, sizeof(buf)) == 0);
+
+	output_cache_stats(&st);
+	assert(st.hits == 1);
+	assert(st.misses == 3);
+	assert(st.expired == 1);
+	assert(st.count == 1);
+
+	output_cache_clear();
+	assert(get("show x", buf, sizeof(buf)) == 0);
+
+	stream_free(s);
+}
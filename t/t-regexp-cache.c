@@ -0,0 +1,80 @@
+#include <assert.h>
+#include <string.h>
+#include <stdio.h>
+
+#include <regexp-cache.h>
+#include "test-runner.h"
+
+TEST(t_regexp_cache_hit) {
+	struct regexp_cache_stats st;
+	struct regexp *re1, *re2, *re3;
+	char err[64];
+
+	regexp_cache_clear();
+
+	re1 = regexp_get("eth[0-9]+", 9, 0, err, sizeof(err));
+	assert(re1 && re1->bc);
+	re2 = regexp_get("eth[0-9]+", 9, 0, err, sizeof(err));
+	assert(re2 == re1);
+	re3 = regexp_get("eth[0-9]+", 9, 1, err, sizeof(err));
+	assert(re3 && re3 != re1);
+
+	regexp_cache_stats(&st);
+	assert(st.hits == 1);
+	assert(st.misses == 2);
+	assert(st.count == 2);
+
+	assert(regexp_get("(", 1, 0, err, sizeof(err)) == NULL);
+
+	regexp_put(re1);
+	regexp_put(re2);
+	regexp_put(re3);
+	regexp_cache_clear();
+}
+
+TEST(t_regexp_cache_evict) {
+	struct regexp_cache_stats st;
+	struct regexp *held, *re;
+	char err[64], pat[16];
+	int i, n;
+
+	regexp_cache_clear();
+
+	/* an evicted entry stays valid while it is referenced */
+	held = regexp_get("held", 4, 0, err, sizeof(err));
+	for (i = 0; i < REGEXP_CACHE_SIZE; i++) {
+		n = snprintf(pat, sizeof(pat), "p%d", i);
+		re = regexp_get(pat, n, 0, err, sizeof(err));
+		assert(re);
+		regexp_put(re);
+	}
+
+	regexp_cache_stats(&st);
+	assert(st.count == REGEXP_CACHE_SIZE);
+	assert(st.evictions == 1);
+	assert(held->bc);
+
+	re = regexp_get("held", 4, 0, err, sizeof(err));
+	assert(re != held);
+	regexp_put(re);
+	regexp_put(held);
+
+	/* p0 went with "held", p1 is touched so "fresh" evicts p2 */
+	re = regexp_get("p1", 2, 0, err, sizeof(err));
+	regexp_put(re);
+	re = regexp_get("fresh", 5, 0, err, sizeof(err));
+	regexp_put(re);
+
+	regexp_cache_stats(&st);
+	n = st.hits;
+	re = regexp_get("p1", 2, 0, err, sizeof(err));
+	regexp_put(re);
+	regexp_cache_stats(&st);
+	assert(st.hits == n + 1);
+	re = regexp_get("p2", 2, 0, err, sizeof(err));
+	regexp_put(re);
+	regexp_cache_stats(&st);
+	assert(st.hits == n + 1);
+
+	regexp_cache_clear();
+}
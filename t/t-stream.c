@@ -0,0 +1,47 @@
+#include <assert.h>
+#include <string.h>
+
+#include <stream.h>
+#include "test-runner.h"
+
+struct lines {
+	int count;
+	size_t bytes;
+	char last[8192];
+};
+
+static int count_line(void *data, const char *line, size_t len)
+{
+	struct lines *l = data;
+
+	l->count++;
+	l->bytes += len;
+	memcpy(l->last, line, len);
+	l->last[len] = '\0';
+
+	return 0;
+}
+
+TEST(t_stream_for_each_line) {
+	struct stream *s = stream_new();
+	struct lines l = { 0 };
+	char line[6000];
+	int i;
+
+	/* lines cross the 4k nodes, one of them is longer than a node */
+	memset(line, 'x', sizeof(line));
+	for (i = 0; i < 100; i++) {
+		stream_put(s, line, 37);
+		stream_put(s, "\r\n", 2);
+	}
+	stream_put(s, line, sizeof(line));
+	stream_put(s, "\n\ntail", 6);
+
+	assert(stream_for_each_line(s, count_line, &l) == 0);
+	assert(l.count == 102);
+	assert(l.bytes == 100 * 37 + sizeof(line) + 4);
+	assert(strcmp(l.last, "tail") == 0);
+	assert(stream_ndata(s) == 0);
+
+	stream_free(s);
+}
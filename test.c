@@ -8,7 +8,6 @@
 #include <sys/types.h>
 #include <sys/wait.h>
 #include "test.h"
-#include "hashtable.h"
 #include "cli-term.h"
 
 TEST(example0, example, example_test0, NULL)
@@ -32,7 +31,36 @@ static int run_test(const struct test *t)
 
 extern const struct test __start_test_section, __stop_test_section;
 
-COMMAND(cmd_test, NULL,
+struct testopt {
+	const char *name;
+	const char *group;
+};
+
+static struct testopt testopt;
+
+static struct optattr test_attrs[] = {
+	{
+		.index = -1,
+		.key = "-name",
+		.offset = offsetof(struct testopt, name),
+		.set = set_strptr,
+	},
+	{
+		.index = -1,
+		.key = "-group",
+		.offset = offsetof(struct testopt, group),
+		.set = set_strptr,
+	},
+};
+
+static struct cmdoptattr test_optattr = {
+	.attrs = test_attrs,
+	.size = sizeof(test_attrs)/sizeof(test_attrs[0]),
+	.buf = &testopt,
+	.bufsize = sizeof(struct testopt),
+};
+
+COMMAND(cmd_test, &test_optattr,
 	"test {-name TEST|-group GROUP}",
 	"system test\n"
 	"name option\n"
@@ -45,8 +73,8 @@ COMMAND(cmd_test, NULL,
 	pid_t pid;
 	int total = 0, pass;
 	siginfo_t info;
-	const char *name = hashtable_get(opt->kpairs, "-name");
-	const char *group = hashtable_get(opt->kpairs, "-group");
+	const char *name = testopt.name;
+	const char *group = testopt.group;
 
 	pass = 0;
 	for (t = &__start_test_section; t < &__stop_test_section; t++) {